@@ -1,16 +1,24 @@
 // eBPF cgroup-connect hooks to force-bind socket to a specific IPv4/IPv6 address.
-// Port is left at 0 to be picked automatically.
+// Addresses are looked up in "force_bind_cgrp" hash map by cgroup id of the process,
+//  then by ids of its parent cgroups up to FORCE_BIND_CGRP_DEPTH levels from root (closest first),
+//  so that entry for e.g. some.slice applies to some.slice/app.service as well,
+//  falling back to entry with id=0 as a default, and sockets are left alone if neither exist.
+// Map entries can be replaced at any time (e.g. via force-bind-ctl -c), atomically,
+//  affecting only new connections, without reloading/detaching programs.
+// Port is left at 0 to be picked automatically, unless set in the map entry.
+// Needs linux-5.7+ for bpf_get_current_cgroup_id() and ancestor one in these hooks.
 
 // Compile:
-//  clang -O2 -fno-stack-protector -Wall \
+//  clang -O2 -g -fno-stack-protector -Wall \
 //   -I/usr/lib/modules/$(uname -r)/build/include \
 //   -target bpf -c cgroup-connect.force-bind.c -o bpf.cgroup-connect.force-bind.o
 //  (note - gcc-10+ circa Q2-2020+ should also have BPF target)
+//  (-g is needed for BTF map definitions)
 
-// Load - swap 4/6 for IPv4/IPv6 ones:
-//  bpftool prog load bpf.cgroup-connect.force-bind.o \
-//   /sys/fs/bpf/cgroup-connect-force-bind4 type cgroup/connect4
-//  (use "bpftool -d" to debug why stuff fails to load)
+// Load/attach/configure:
+//  ./force-bind-ctl -c attach -4 10.16.0.17 -6 fd10::17 /sys/fs/cgroup/some.slice
+//  ./force-bind-ctl -c set -g /sys/fs/cgroup/some.slice/other.scope -4 10.16.0.18
+//  (use "bpftool -d" to debug why stuff fails to load, and -n to print bpftool commands)
 
 #include <linux/version.h>
 #include <uapi/linux/bpf.h>
@@ -44,26 +52,68 @@ struct sockaddr_in6 {
 };
 
 
+// Values are in network byte order, all-zero addr4/addr6 is not bound
+// Same struct as in cgroup-sendmsg.force-bind.c
+struct force_bind_conf {
+	__be32 addr4;
+	__be32 addr6[4];
+	__be16 port;
+	__u16 _pad;
+};
+
+// Hash map values are replaced atomically on update, unlike array ones
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, 4096);
+	__type(key, __u64); // cgroup id - inode number of cgroup2 dir, or 0
+	__type(value, struct force_bind_conf);
+} force_bind_cgrp SEC(".maps");
+
+// Max cgroup nesting level to check parent cgroups at, e.g. 3 for /a.slice/b.slice/c.service
+#ifndef FORCE_BIND_CGRP_DEPTH
+#define FORCE_BIND_CGRP_DEPTH 8
+#endif
+
+static __always_inline struct force_bind_conf *conf_get(void) {
+	__u64 cg = bpf_get_current_cgroup_id(), key = cg;
+	struct force_bind_conf *conf = bpf_map_lookup_elem(&force_bind_cgrp, &key);
+	if (conf) return conf;
+	// Ancestor id is 0 for levels below process cgroup, or same id at its own level
+	#pragma unroll
+	for (int level = FORCE_BIND_CGRP_DEPTH; level > 0; level--) {
+		key = bpf_get_current_ancestor_cgroup_id(level);
+		if (!key || key == cg) continue;
+		if ((conf = bpf_map_lookup_elem(&force_bind_cgrp, &key))) return conf; }
+	key = 0;
+	return bpf_map_lookup_elem(&force_bind_cgrp, &key);
+}
+
+
 
 SEC("cgroup/connect4")
 int connect4_force_bind(struct bpf_sock_addr *ctx) {
-	// s_addr can be generated via: ip.ip_address('10.16.0.17').packed.hex()
+	struct force_bind_conf *conf = conf_get();
+	if (!conf || !conf->addr4) return 1;
 	struct sockaddr_in sa = {};
 	sa.sin_family = AF_INET;
-	sa.sin_addr.s_addr = bpf_htonl(0x0a100011);
+	sa.sin_addr.s_addr = conf->addr4;
+	sa.sin_port = conf->port;
 	if (bpf_bind(ctx, (struct sockaddr *)&sa, sizeof(sa)) != 0) return 0;
 	return 1;
 }
 
 SEC("cgroup/connect6")
 int connect6_force_bind(struct bpf_sock_addr *ctx) {
-	// s6_addr can be generated via: ip.ip_address('fd10::17').packed.hex()
+	struct force_bind_conf *conf = conf_get();
+	if ( !conf || !(conf->addr6[0]
+		|| conf->addr6[1] || conf->addr6[2] || conf->addr6[3]) ) return 1;
 	struct sockaddr_in6 sa = {};
 	sa.sin6_family = AF_INET6;
-	sa.sin6_addr.s6_addr32[0] = bpf_htonl(0xfd100000);
-	sa.sin6_addr.s6_addr32[1] = 0;
-	sa.sin6_addr.s6_addr32[2] = 0;
-	sa.sin6_addr.s6_addr32[3] = bpf_htonl(0x00000017);
+	sa.sin6_addr.s6_addr32[0] = conf->addr6[0];
+	sa.sin6_addr.s6_addr32[1] = conf->addr6[1];
+	sa.sin6_addr.s6_addr32[2] = conf->addr6[2];
+	sa.sin6_addr.s6_addr32[3] = conf->addr6[3];
+	sa.sin6_port = conf->port;
 	if (bpf_bind(ctx, (struct sockaddr *)&sa, sizeof(sa)) != 0) return 0;
 	return 1;
 }
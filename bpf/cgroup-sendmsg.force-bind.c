@@ -0,0 +1,97 @@
+// eBPF cgroup-sendmsg/bind hooks to force UDP sockets to use specific local IPv4/IPv6 address/port.
+// Same idea as mosh-nat-bind.c LD_PRELOAD lib, but works for any binaries in a cgroup.
+// Address/port are read from "force_bind_conf" map, see force-bind-ctl tool to set those.
+
+// sendmsg4/6 hooks can only set source address for unconnected UDP sockets,
+//  while port is picked by kernel on first send, so bind4/6 hooks are used
+//  to set port (and address) for sockets that call bind() explicitly, incl. with port=0.
+// cgroup-connect.force-bind.c can be used in addition to that for connected sockets.
+
+// Compile:
+//  clang -O2 -g -fno-stack-protector -Wall \
+//   -I/usr/lib/modules/$(uname -r)/build/include \
+//   -target bpf -c cgroup-sendmsg.force-bind.c -o bpf.cgroup-sendmsg.force-bind.o
+//  (note - gcc-10+ circa Q2-2020+ should also have BPF target)
+//  (-g is needed for BTF map definitions)
+
+// Load/attach/configure:
+//  ./force-bind-ctl attach -4 10.16.0.17 /sys/fs/cgroup/some.slice
+//  (-p option can also be added, but only affects sockets that call bind(), see above)
+//  (or see that script for bpftool commands that it runs)
+
+#include <linux/version.h>
+#include <uapi/linux/bpf.h>
+#include <bpf/bpf_helpers.h>
+
+
+#define SOCK_DGRAM 2
+
+// Values are in network byte order, and all-zero ones are not changed
+struct force_bind_conf {
+	__be32 addr4;
+	__be32 addr6[4];
+	__be16 port;
+	__u16 _pad;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, __u32);
+	__type(value, struct force_bind_conf);
+} force_bind_conf SEC(".maps");
+
+static __always_inline struct force_bind_conf *conf_get(struct bpf_sock_addr *ctx) {
+	if (ctx->type != SOCK_DGRAM) return 0;
+	__u32 key = 0;
+	return bpf_map_lookup_elem(&force_bind_conf, &key);
+}
+
+static __always_inline int conf_addr6(struct force_bind_conf *conf) {
+	return conf->addr6[0] || conf->addr6[1] || conf->addr6[2] || conf->addr6[3];
+}
+
+
+
+SEC("cgroup/sendmsg4")
+int sendmsg4_fbind(struct bpf_sock_addr *ctx) {
+	struct force_bind_conf *conf = conf_get(ctx);
+	if (conf && conf->addr4) ctx->msg_src_ip4 = conf->addr4;
+	return 1;
+}
+
+SEC("cgroup/sendmsg6")
+int sendmsg6_fbind(struct bpf_sock_addr *ctx) {
+	struct force_bind_conf *conf = conf_get(ctx);
+	if (!conf || !conf_addr6(conf)) return 1;
+	ctx->msg_src_ip6[0] = conf->addr6[0];
+	ctx->msg_src_ip6[1] = conf->addr6[1];
+	ctx->msg_src_ip6[2] = conf->addr6[2];
+	ctx->msg_src_ip6[3] = conf->addr6[3];
+	return 1;
+}
+
+SEC("cgroup/bind4")
+int bind4_fbind(struct bpf_sock_addr *ctx) {
+	struct force_bind_conf *conf = conf_get(ctx);
+	if (!conf) return 1;
+	if (conf->addr4) ctx->user_ip4 = conf->addr4;
+	if (conf->port) ctx->user_port = conf->port;
+	return 1;
+}
+
+SEC("cgroup/bind6")
+int bind6_fbind(struct bpf_sock_addr *ctx) {
+	struct force_bind_conf *conf = conf_get(ctx);
+	if (!conf) return 1;
+	if (conf_addr6(conf)) {
+		ctx->user_ip6[0] = conf->addr6[0];
+		ctx->user_ip6[1] = conf->addr6[1];
+		ctx->user_ip6[2] = conf->addr6[2];
+		ctx->user_ip6[3] = conf->addr6[3]; }
+	if (conf->port) ctx->user_port = conf->port;
+	return 1;
+}
+
+char _license[] SEC("license") = "GPL";
+u32 _version SEC("version") = LINUX_VERSION_CODE;
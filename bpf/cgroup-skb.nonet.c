@@ -1,24 +1,43 @@
-// eBPF filter to disable network access except for IPv4/IPv6 localhost.
+// eBPF filter to disable network access except for IPv4/IPv6 localhost,
+//  and remote addresses in nonet_allow4/nonet_allow6 LPM-trie maps, if any.
+// Remote address/port is destination for egress packets (drop_all_packets prog),
+//  and source for ingress ones (drop_all_packets_ingress prog, for "nonet-ctl attach -i"),
+//  so same allowlist rules work for both directions.
+// Allowlist map keys are proto + port + addr, with prefixlen = 24 + addr prefix bits,
+//  where proto=0 and port=0 match any protocol/port, so each packet is looked up
+//  (up to) three times - with proto+port, proto-only and neither, each O(prefix length).
+// Ports are only checked for TCP/UDP/SCTP and first IPv4 fragments,
+//  and IPv6 extension headers are not parsed, so only proto-only/neither rules work there.
+// Counts packets/bytes for each cgroup/verdict/proto/port/remote in nonet_stats per-cpu map,
+//  and sends rate-limited samples of dropped packets to nonet_drops ringbuf,
+//  which can be read via "nonet-ctl stats" and "nonet-ctl drops" commands.
+// Sample rate (per cpu per second) can be set via -DNONET_SAMPLE_RATE=n (EBPF_EXTRA_CFLAGS).
 
 // Compile:
-//  clang -O2 -fno-stack-protector -Wall \
+//  clang -O2 -g -fno-stack-protector -Wall \
 //   -I/usr/lib/modules/$(uname -r)/build/include \
 //   -target bpf -c cgroup-skb.nonet.c -o bpf.cgroup-skb.nonet.o
 //  (note - gcc-10+ circa Q2-2020+ should also have BPF target)
+//  (-g is needed for BTF map definitions)
 
-// Load:
-//  bpftool prog load bpf.cgroup-skb.nonet.o \
-//   /sys/fs/bpf/cgroup-skb-nonet type cgroup/skb
-//  (use "bpftool -d" to debug why stuff fails to load)
+// Load/attach/configure:
+//  ./nonet-ctl attach /sys/fs/cgroup/build.slice
+//  ./nonet-ctl allow 10.1.2.0/24 -t tcp -p 443
+//  (use "bpftool -d" to debug why stuff fails to load, and nonet-ctl -n to print bpftool commands)
 
 #include <linux/version.h>
 #include <uapi/linux/bpf.h>
 #include <bpf/bpf_helpers.h>
+#include <bpf/bpf_endian.h>
 
 
 #define ETH_P_IP 0x8
 #define ETH_P_IPV6 0xdd86
 
+#define IPPROTO_TCP 6
+#define IPPROTO_UDP 17
+#define IPPROTO_SCTP 132
+
 struct iphdr {
 	__u8 ihl : 4;
 	__u8 version : 4;
@@ -47,8 +66,185 @@ struct ipv6hdr {
 } __attribute__((packed));
 
 
-SEC("cgroup/skb")
-int drop_all_packets(struct __sk_buff *skb) {
+// LPM trie keys, with proto/port in front of address, to match those exactly
+struct nonet_key4 {
+	__u32 prefixlen;
+	__u8 proto;
+	__be16 port;
+	__u8 addr[4];
+} __attribute__((packed));
+
+struct nonet_key6 {
+	__u32 prefixlen;
+	__u8 proto;
+	__be16 port;
+	__u8 addr[16];
+} __attribute__((packed));
+
+struct {
+	__uint(type, BPF_MAP_TYPE_LPM_TRIE);
+	__uint(max_entries, 1024);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__type(key, struct nonet_key4);
+	__type(value, __u32); // unused
+} nonet_allow4 SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_LPM_TRIE);
+	__uint(max_entries, 1024);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__type(key, struct nonet_key6);
+	__type(value, __u32); // unused
+} nonet_allow6 SEC(".maps");
+
+// Looks up key with proto+port, then proto-only, then neither - key is modified
+#define nonet_allowed(map, key) ( bpf_map_lookup_elem(map, key) \
+	|| (key->port && !(key->port = 0) && bpf_map_lookup_elem(map, key)) \
+	|| (key->proto && !(key->proto = 0) && bpf_map_lookup_elem(map, key)) )
+
+// Packet/byte counters for each cgroup + verdict + proto + remote addr/port,
+//  in per-cpu hash map, to be summed up in userspace (e.g. by "nonet-ctl stats").
+// New entries are not added when map is full, until it's cleared from userspace.
+struct nonet_stat_key {
+	__u64 cgroup;
+	__u8 verdict; // 1 = allow, 0 = drop
+	__u8 proto;
+	__be16 port;
+	__u8 family; // 4 or 6, 0 for non-IP packets
+	__u8 _pad[3];
+	__u8 addr[16];
+};
+
+struct nonet_stat {
+	__u64 packets;
+	__u64 bytes;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_HASH);
+	__uint(max_entries, 16384);
+	__type(key, struct nonet_stat_key);
+	__type(value, struct nonet_stat);
+} nonet_stats SEC(".maps");
+
+// Samples of dropped packets, rate-limited by a per-cpu counter for current second
+#ifndef NONET_SAMPLE_RATE
+#define NONET_SAMPLE_RATE 20
+#endif
+
+struct nonet_sample {
+	struct nonet_stat_key key;
+	__u64 ts; // CLOCK_MONOTONIC
+	__u32 len;
+	__u32 _pad;
+};
+
+struct nonet_sample_rl {
+	__u64 ts_sec;
+	__u64 n;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, __u32);
+	__type(value, struct nonet_sample_rl);
+} nonet_sample_rl SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_RINGBUF);
+	__uint(max_entries, 256 * 1024);
+} nonet_drops SEC(".maps");
+
+static __always_inline int port_proto(__u8 proto) {
+	return proto == IPPROTO_TCP || proto == IPPROTO_UDP || proto == IPPROTO_SCTP;
+}
+
+
+// Parses packet into stats key and returns verdict for it - 1 = allow, 0 = drop
+// Remote addr/port are dst for egress and src for ingress, ingress flag is constant per prog
+static __always_inline int nonet_verdict(
+		struct __sk_buff *skb, struct nonet_stat_key *st, int ingress ) {
+	// src/dst ports are at offsets 0/2 in TCP/UDP/SCTP headers
+	int port_offset = ingress ? 0 : 2;
+	if (skb->protocol == ETH_P_IP) {
+		__u8 ihl; __be16 frag_off;
+		st->family = 4;
+		if ( bpf_skb_load_bytes(skb, 0, &ihl, 1)
+			|| bpf_skb_load_bytes( skb,
+				offsetof(struct iphdr, frag_off), &frag_off, sizeof(frag_off) )
+			|| bpf_skb_load_bytes( skb,
+				offsetof(struct iphdr, protocol), &st->proto, sizeof(st->proto) )
+			|| bpf_skb_load_bytes( skb,
+				ingress ? offsetof(struct iphdr, saddr)
+					: offsetof(struct iphdr, daddr), &st->addr, 4 ) ) return 0;
+		// Non-first fragments don't have L4 header with ports
+		if ( port_proto(st->proto) && !(bpf_ntohs(frag_off) & 0x1fff)
+			&& bpf_skb_load_bytes( skb,
+				(ihl & 0xf) * 4 + port_offset, &st->port, sizeof(st->port) ) )
+				st->port = 0;
+
+		// IPv4 localhost - 127.0.0.1
+		if (*(__u32 *) st->addr == 0x100007f) return 1;
+
+		struct nonet_key4 key4 = {
+			.prefixlen=8 * (sizeof(key4) - 4), .proto=st->proto, .port=st->port }, *key = &key4;
+		__builtin_memcpy(key4.addr, st->addr, sizeof(key4.addr));
+		return nonet_allowed(&nonet_allow4, key) ? 1 : 0; }
+
+	if (skb->protocol == ETH_P_IPV6) {
+		st->family = 6;
+		if ( bpf_skb_load_bytes( skb,
+				offsetof(struct ipv6hdr, nexthdr), &st->proto, sizeof(st->proto) )
+			|| bpf_skb_load_bytes( skb,
+				ingress ? offsetof(struct ipv6hdr, saddr1)
+					: offsetof(struct ipv6hdr, daddr1), &st->addr, sizeof(st->addr) ) ) return 0;
+		if ( port_proto(st->proto) && bpf_skb_load_bytes( skb,
+				sizeof(struct ipv6hdr) + port_offset, &st->port, sizeof(st->port) ) ) st->port = 0;
+
+		// IPv6 localhost - [::1]
+		if ( ((__u64 *) st->addr)[0] == 0
+			&& ((__u64 *) st->addr)[1] == 0x100000000000000 ) return 1;
+
+		struct nonet_key6 key6 = {
+			.prefixlen=8 * (sizeof(key6) - 4), .proto=st->proto, .port=st->port }, *key = &key6;
+		__builtin_memcpy(key6.addr, st->addr, sizeof(key6.addr));
+		return nonet_allowed(&nonet_allow6, key) ? 1 : 0; }
+
+	return 0; // block everything else
+}
+
+// Per-cpu values are only updated from same cpu, but egress hook can still be
+//  interrupted there by ingress one in softirq (with "nonet-ctl attach -i"),
+//  so atomic adds are used, which are uncontended and cheap on cpu-local values
+static __always_inline void nonet_count(struct __sk_buff *skb, struct nonet_stat_key *st) {
+	struct nonet_stat *stat = bpf_map_lookup_elem(&nonet_stats, st);
+	if (!stat) {
+		struct nonet_stat stat_new = {.packets=1, .bytes=skb->len};
+		if (!bpf_map_update_elem(&nonet_stats, st, &stat_new, BPF_NOEXIST)) return;
+		// Same entry can be added by interrupting hook in-between, or map can be full
+		if (!(stat = bpf_map_lookup_elem(&nonet_stats, st))) return; }
+	__sync_fetch_and_add(&stat->packets, 1);
+	__sync_fetch_and_add(&stat->bytes, skb->len);
+}
+
+// Sends sample of dropped packet to ringbuf, up to NONET_SAMPLE_RATE per second on each cpu
+// Rate-limit is approximate, as ingress hook can interrupt egress one on same cpu
+//  between its check and update, allowing few extra samples (or lost updates) there
+static __always_inline void nonet_sample(struct __sk_buff *skb, struct nonet_stat_key *st) {
+	__u32 key = 0;
+	struct nonet_sample_rl *rl = bpf_map_lookup_elem(&nonet_sample_rl, &key);
+	if (!rl) return;
+	__u64 ts = bpf_ktime_get_ns(), ts_sec = ts / 1000000000;
+	if (rl->ts_sec != ts_sec) { rl->ts_sec = ts_sec; rl->n = 0; }
+	if (rl->n >= NONET_SAMPLE_RATE) return;
+	rl->n++;
+	struct nonet_sample sample = {.key=*st, .ts=ts, .len=skb->len};
+	bpf_ringbuf_output(&nonet_drops, &sample, sizeof(sample), 0);
+}
+
+
+static __always_inline int nonet_filter(struct __sk_buff *skb, int ingress) {
 	// See: bpf-helpers(7), tc-bpf(8)
 	//   https://docs.ebpf.io/linux/program-type/BPF_PROG_TYPE_CGROUP_SKB/
 	//   https://www.kernel.org/doc/Documentation/networking/filter.txt
@@ -57,25 +253,19 @@ int drop_all_packets(struct __sk_buff *skb) {
 	/* char fmt[] = "addr %x\n"; */
 	/* bpf_trace_printk(fmt, sizeof(fmt), addr); */
 
-	__u32 dst_ip = 0;
-	__u64 dst_ip6a = 0, dst_ip6b = 0;
-
-	// IPv4 localhost - 127.0.0.1
-	if ( skb->protocol == ETH_P_IP
-		&& !bpf_skb_load_bytes( skb,
-			offsetof(struct iphdr, daddr), &dst_ip, sizeof(dst_ip) )
-		&& dst_ip == 0x100007f ) return 1;
+	struct nonet_stat_key st = {};
+	st.cgroup = bpf_skb_cgroup_id(skb);
+	st.verdict = nonet_verdict(skb, &st, ingress);
+	nonet_count(skb, &st);
+	if (!st.verdict) nonet_sample(skb, &st);
+	return st.verdict;
+}
 
-	// IPv6 localhost - [::1]
-	if ( skb->protocol == ETH_P_IPV6
-		&& !bpf_skb_load_bytes( skb,
-			offsetof(struct ipv6hdr, daddr1), &dst_ip6a, sizeof(dst_ip6a) )
-		&& !bpf_skb_load_bytes( skb,
-			offsetof(struct ipv6hdr, daddr2), &dst_ip6b, sizeof(dst_ip6b) )
-		&& dst_ip6a == 0 && dst_ip6b == 0x100000000000000 ) return 1;
+SEC("cgroup/skb")
+int drop_all_packets(struct __sk_buff *skb) { return nonet_filter(skb, 0); }
 
-	return 0; // block everything else
-}
+SEC("cgroup/skb")
+int drop_all_packets_ingress(struct __sk_buff *skb) { return nonet_filter(skb, 1); }
 
 
 char _license[] SEC("license") = "GPL";
@@ -1,55 +1,850 @@
 //
-// Build with: gcc -O2 -o fast-disk-wipe fast-disk-wipe.c
+// Build with: gcc -O2 -pthread -o fast-disk-wipe fast-disk-wipe.c
 // Usage (print usage info): ./fast-disk-wipe
 //
 
+#define _GNU_SOURCE // O_DIRECT
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/falloc.h>
+#include <stdint.h>
+#include <sys/random.h>
+#include <sys/sysmacros.h>
+#include <linux/io_uring.h>
 #include <fcntl.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
 #include <locale.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
 
-int main(int argc, char *argv[]) {
-	if (argc < 2 || argc > 4) {
-		printf("Usage: %s /dev/sdX [interval=10] [bs=512]\n", argv[0]);
-		printf("Writes 512B NUL-byte blocks to a device with 10-block intervals.\n");
-		return -1; }
-	setlocale(LC_ALL, ""); // user selected locale
 
-	if (access(argv[1], W_OK)) {
-		fprintf(stderr, "ERROR: access(%s, W_OK) failed - %s\n", argv[1], strerror(errno));
-		return 33; }
+// Minimal raw-syscall io_uring wrapper, to avoid liburing dependency
+struct uring {
+	int fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes; };
 
-	int interval = atoi(argc > 2 ? argv[2] : "10");
-	if (interval <= 0) {
-		fprintf(stderr, "ERROR: Failed to parse interval value '%s'\n", argv[2]);
-		return 34; }
+int uring_init(struct uring *r, unsigned depth) {
+	struct io_uring_params p = {0};
+	if ((r->fd = syscall(SYS_io_uring_setup, depth, &p)) < 0) return -1;
+	// IORING_OP_WRITE is from 5.6, same as this feature flag
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_RW_CUR_POS)) {
+		close(r->fd); errno = EOPNOTSUPP; return -1; }
 
-	int bs = atoi(argc > 3 ? argv[3] : "512");
-	if (bs <= 0) {
-		fprintf(stderr, "ERROR: Failed to parse block-size value '%s'\n", argv[3]);
-		return 35; }
+	size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (cq_len > sq_len) sq_len = cq_len;
+	void *sq = mmap( NULL, sq_len, PROT_READ|PROT_WRITE,
+		MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQ_RING );
+	void *sqes = mmap( NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+		PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQES );
+	if (sq == MAP_FAILED || sqes == MAP_FAILED) { close(r->fd); return -1; }
+
+	r->sq_head = sq + p.sq_off.head; r->sq_tail = sq + p.sq_off.tail;
+	r->sq_mask = sq + p.sq_off.ring_mask; r->sq_array = sq + p.sq_off.array;
+	r->cq_head = sq + p.cq_off.head; r->cq_tail = sq + p.cq_off.tail;
+	r->cq_mask = sq + p.cq_off.ring_mask; r->cqes = sq + p.cq_off.cqes;
+	r->sqes = sqes;
+	return 0; }
+
+void uring_queue_rw(struct uring *r, int op, int fd, void *buff, int len, off_t offset) {
+	unsigned tail = *r->sq_tail, idx = tail & *r->sq_mask;
+	struct io_uring_sqe *sqe = &r->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op; sqe->fd = fd;
+	sqe->addr = (unsigned long) buff; sqe->len = len;
+	sqe->off = offset; sqe->user_data = offset;
+	r->sq_array[idx] = idx;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE); }
+
+int uring_submit_wait(struct uring *r, unsigned n_submit, unsigned n_wait) {
+	int res;
+	do res = syscall( SYS_io_uring_enter, r->fd,
+		n_submit, n_wait, IORING_ENTER_GETEVENTS, NULL, 0 );
+	while (res < 0 && errno == EINTR);
+	return res; }
+
+struct io_uring_cqe *uring_cqe_peek(struct uring *r) {
+	unsigned head = *r->cq_head;
+	if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+	return &r->cqes[head & *r->cq_mask]; }
+
+void uring_cqe_seen(struct uring *r) {
+	__atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE); }
+
+
+volatile sig_atomic_t wipe_stop = 0; // set on SIGINT/SIGTERM, to checkpoint and exit
+
+void wipe_stop_handler(int sig) { wipe_stop = 1; }
+
+uint64_t ts_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000; }
+
+
+// Per-write latency histogram, with log2(us) buckets, i.e. bucket-N is for <2^N us
+#define WIPE_LAT_BUCKETS 40
+
+// Slot for one in-flight io_uring write, indexed by stride-number within queue window
+struct wipe_slot { uint64_t ts; bool done, bad; void *buff; };
+
+
+// Shared in-flight I/O budget for all devices on same controller/HBA (-Q option)
+struct wipe_ctl {
+	char *key; int avail; struct wipe_ctl *next;
+	pthread_mutex_t lock; pthread_cond_t cond; };
+
+// Takes up to n I/O slots from controller budget, blocking until at least one is free if wait=true
+int wipe_ctl_take(struct wipe_ctl *ctl, int n, bool wait) {
+	if (!ctl) return n;
+	pthread_mutex_lock(&ctl->lock);
+	while (wait && !ctl->avail) pthread_cond_wait(&ctl->cond, &ctl->lock);
+	if (n > ctl->avail) n = ctl->avail;
+	ctl->avail -= n;
+	pthread_mutex_unlock(&ctl->lock);
+	return n; }
+
+void wipe_ctl_give(struct wipe_ctl *ctl, int n) {
+	if (!ctl || !n) return;
+	pthread_mutex_lock(&ctl->lock);
+	ctl->avail += n;
+	pthread_cond_broadcast(&ctl->cond);
+	pthread_mutex_unlock(&ctl->lock); }
+
+
+// Fill types for -f option, where random one is counter-based, i.e. data at any offset
+//  is generated independently from seed and offset, without sequential PRNG state,
+//  so that it can be split between threads and re-generated for checks
+enum { FILL_ZERO, FILL_PATTERN, FILL_RANDOM };
+struct wipe_fill { int type; uint64_t seed; char *pattern; int pattern_len; char *spec; };
+
+// splitmix64 finalizer over counter, simple enough for compiler to unroll/vectorize
+static inline uint64_t fill_rand64(uint64_t ctr) {
+	ctr *= 0x9e3779b97f4a7c15ULL;
+	ctr = (ctr ^ (ctr >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	ctr = (ctr ^ (ctr >> 27)) * 0x94d049bb133111ebULL;
+	return ctr ^ (ctr >> 31); }
+
+void fill_random(struct wipe_fill *fill, void *buff, int len, off_t offset) {
+	uint64_t ctr = fill->seed ^ ((uint64_t) offset * 0xd1b54a32d192ed03ULL), w;
+	uint64_t *words = buff; int n = len / 8;
+	for (int k = 0; k < n; k++) words[k] = fill_rand64(ctr + k);
+	if (len % 8) { w = fill_rand64(ctr + n); memcpy(words + n, &w, len % 8); } }
+
+// Checks whether buffer matches expected fill, without early exit, for loop vectorization
+bool fill_check(struct wipe_fill *fill, void *block, void *buff, int len, off_t offset) {
+	uint64_t *words = buff, acc = 0, w = 0; int n = len / 8;
+	if (fill->type == FILL_PATTERN) return !memcmp(buff, block, len);
+	if (fill->type == FILL_ZERO) for (int k = 0; k < n; k++) acc |= words[k];
+	else {
+		uint64_t ctr = fill->seed ^ ((uint64_t) offset * 0xd1b54a32d192ed03ULL);
+		for (int k = 0; k < n; k++) acc |= words[k] ^ fill_rand64(ctr + k);
+		w = fill_rand64(ctr + n); }
+	return !acc && !memcmp(words + n, &w, len % 8); }
+
+void fill_block(struct wipe_fill *fill, void *buff, int len) {
+	if (fill->type == FILL_PATTERN)
+		for (int n = 0; n < len; n += fill->pattern_len)
+			memcpy( buff + n, fill->pattern,
+				len - n < fill->pattern_len ? len - n : fill->pattern_len );
+	else memset(buff, 0, len); }
+
+// Parses zero, hex:<bytes> or random[:seed] spec, returns non-zero on error
+int fill_parse(struct wipe_fill *fill, char *spec) {
+	*fill = (struct wipe_fill) {.spec=spec};
+	if (!strcmp(spec, "zero")) fill->type = FILL_ZERO;
+	else if (!strncmp(spec, "hex:", 4)) {
+		int n = strlen(spec + 4);
+		if (!n || n % 2 || !(fill->pattern = malloc(n / 2))) return -1;
+		for (fill->pattern_len = 0; fill->pattern_len < n / 2; fill->pattern_len++)
+			if (sscanf(spec + 4 + fill->pattern_len * 2, "%2hhx", fill->pattern + fill->pattern_len) != 1)
+				return -1;
+		fill->type = FILL_PATTERN; }
+	else if (!strcmp(spec, "random")) {
+		if (getrandom(&fill->seed, sizeof(fill->seed), 0) != sizeof(fill->seed)) return -1;
+		fill->type = FILL_RANDOM; }
+	else if (!strncmp(spec, "random:", 7)) {
+		char *end; fill->seed = strtoull(spec + 7, &end, 16);
+		if (!spec[7] || *end) return -1;
+		fill->type = FILL_RANDOM; }
+	else return -1;
+	return 0; }
+
+// Wipe parameters and results for one contiguous device region
+// Regions are wiped by separate threads with pwrite() or io_uring, no shared file offset
+// Same jobs are used for verification, reading blocks into per-slot buffers instead
+// n/n_bytes/n_sys/pos/lat counters are updated atomically, to be read by progress reports
+struct wipe_job {
+	int fd, bs, depth; void *block; // block is used for all writes with non-random fill
+	struct wipe_fill *fill; void *buff; // buffer for random data or reads with pwrite() loop
+	bool verify; off_t n_bad, bad_start, bad_end; char *prefix; // mismatch stats for verify
+	off_t stride, start, end; // end=0 - until write fails at the end of device
+	off_t begin, pos; // first offset to write (resume), and offset before which all is done
+	int *mechs, mechs_used; bool whole; // hw mechanisms to try in order, bitmask of used ones
+	struct uring r; struct wipe_slot *slots; pthread_t thread; struct wipe_ctl *ctl;
+	off_t n, n_bytes, n_sys; uint64_t lat[WIPE_LAT_BUCKETS]; int err; bool finished;
+	pthread_mutex_t *done_lock; pthread_cond_t *done_cond; }; // to wake up device thread when finished
+
+// Returns length of block to write at offset, or 0 after the end of job region
+int wipe_block_len(struct wipe_job *job, off_t offset) {
+	if (!job->end) return job->bs;
+	if (offset >= job->end) return 0;
+	return job->end - offset < job->bs ? job->end - offset : job->bs; }
+
+void wipe_block_done(struct wipe_job *job, off_t offset, uint64_t ts) {
+	off_t pos = offset + job->stride;
+	if (job->end && pos > job->end) pos = job->end;
+	__atomic_add_fetch(&job->n, 1, __ATOMIC_RELAXED);
+	if (pos - job->begin > job->n_bytes)
+		__atomic_store_n(&job->n_bytes, pos - job->begin, __ATOMIC_RELAXED);
+	ts = ts_us() - ts;
+	__atomic_add_fetch( &job->lat[ ts ? (64 - __builtin_clzll(ts) < WIPE_LAT_BUCKETS
+		? 64 - __builtin_clzll(ts) : WIPE_LAT_BUCKETS - 1) : 0 ], 1, __ATOMIC_RELAXED ); }
+
+void wipe_block_fail(struct wipe_job *job, int res) {
+	// Failed writes are expected at the end of device when its size is unknown
+	if (job->end && !job->err) job->err = res < 0 ? -res : EIO; }
+
+// Verified blocks are retired in offset order, to report contiguous mismatched ranges
+void wipe_verify_retire(struct wipe_job *job, off_t offset, bool bad) {
+	if (bad) {
+		if (job->bad_start < 0) job->bad_start = offset;
+		job->bad_end = offset + wipe_block_len(job, offset); job->n_bad++; return; }
+	if (job->bad_start < 0) return;
+	printf( "%sMISMATCH: blocks in range [%'lld - %'lld] do not match expected fill\n",
+		job->prefix, (long long) job->bad_start, (long long) job->bad_end );
+	job->bad_start = -1; }
+
+void wipe_loop(struct wipe_job *job) {
+	int len; ssize_t res; uint64_t ts;
+	for (off_t offset = job->pos; !wipe_stop
+			&& (len = wipe_block_len(job, offset)); offset += job->stride) {
+		if (!job->verify && job->fill->type == FILL_RANDOM)
+			fill_random(job->fill, job->buff, len, offset);
+		wipe_ctl_take(job->ctl, 1, true);
+		ts = ts_us();
+		if (job->verify) res = pread(job->fd, job->buff, len, offset);
+		else res = pwrite( job->fd, job->fill->type == FILL_RANDOM
+			? job->buff : job->block, len, offset );
+		wipe_ctl_give(job->ctl, 1);
+		__atomic_add_fetch(&job->n_sys, 1, __ATOMIC_RELAXED);
+		if (res < len) { wipe_block_fail(job, res < 0 ? -errno : 0); break; }
+		wipe_block_done(job, offset, ts);
+		if (job->verify) wipe_verify_retire( job, offset,
+			!fill_check(job->fill, job->block, job->buff, len, offset) );
+		__atomic_store_n(&job->pos, offset + job->stride, __ATOMIC_RELAXED); } }
+
+void wipe_uring(struct wipe_job *job) {
+	// Same zero/pattern block is used as a source for all writes, as it never changes
+	// Random data is generated into per-slot buffers, while other slots are being written
+	// Verification reads into per-slot buffers, checking them as reads complete
+	// Offsets are only issued in increasing order, so first failure marks end of device
+	// Window of issued writes is limited to depth strides after pos, to reuse their slots
+	// Controller budget is only waited on with nothing in-flight, otherwise waiting for cqes
+	// Starts from pos, which can be after begin, if hw mechanisms were used for some ranges
+	off_t offset = job->pos, pos = job->pos;
+	unsigned inflight = 0, n_submit, n_reaped, n_ctl = 0;
+	bool done = false;
+	int len;
+	struct io_uring_cqe *cqe;
+	struct wipe_slot *slot;
+	#define wipe_slot(o) (job->slots + ((o) - job->begin) / job->stride % job->depth)
+	while (true) {
+		for (n_submit = 0; !done && offset < pos + job->depth * job->stride; n_submit++) {
+			if (wipe_stop || !(len = wipe_block_len(job, offset))) { done = true; break; }
+			if ( !n_ctl && !(n_ctl = wipe_ctl_take( job->ctl,
+				(pos - offset) / job->stride + job->depth, !inflight && !n_submit )) ) break;
+			n_ctl--;
+			slot = wipe_slot(offset);
+			if (!job->verify && job->fill->type == FILL_RANDOM)
+				fill_random(job->fill, slot->buff, len, offset);
+			slot->ts = ts_us(); slot->done = false;
+			if (job->verify) uring_queue_rw(&job->r, IORING_OP_READ, job->fd, slot->buff, len, offset);
+			else uring_queue_rw( &job->r, IORING_OP_WRITE, job->fd,
+				job->fill->type == FILL_RANDOM ? slot->buff : job->block, len, offset );
+			offset += job->stride; }
+		wipe_ctl_give(job->ctl, n_ctl); n_ctl = 0;
+		if (!n_submit && !inflight) break;
+		__atomic_add_fetch(&job->n_sys, 1, __ATOMIC_RELAXED);
+		if (uring_submit_wait(&job->r, n_submit, 1) < 0) {
+			fprintf(stderr, "ERROR: io_uring_enter failed - %s\n", strerror(errno));
+			job->err = errno; break; }
+		inflight += n_submit; n_reaped = 0;
+		while ((cqe = uring_cqe_peek(&job->r))) {
+			if (cqe->res < wipe_block_len(job, cqe->user_data)) {
+				wipe_block_fail(job, cqe->res); done = true; }
+			else {
+				slot = wipe_slot(cqe->user_data); slot->done = true;
+				wipe_block_done(job, cqe->user_data, slot->ts);
+				if (job->verify) slot->bad = !fill_check( job->fill,
+					job->block, slot->buff, cqe->res, cqe->user_data ); }
+			uring_cqe_seen(&job->r); inflight--; n_reaped++; }
+		wipe_ctl_give(job->ctl, n_reaped);
+		for (; pos < offset && wipe_slot(pos)->done; pos += job->stride)
+			if (job->verify) wipe_verify_retire(job, pos, wipe_slot(pos)->bad);
+		__atomic_store_n(&job->pos, pos, __ATOMIC_RELAXED); }
+	#undef wipe_slot
+}
+
+
+// Hardware discard/write-zeroes mechanisms, tried in order for each region
+// Any range falls back to next one on EOPNOTSUPP/ENOTTY (e.g. ioctl on file),
+//  which is then used for all ranges after it, and to regular writes after all of them.
+enum { WIPE_WRITE, WIPE_ZEROOUT, WIPE_DISCARD, WIPE_SECDISCARD, WIPE_ZERO_RANGE, WIPE_PUNCH_HOLE };
+const char *wipe_mech_names[] = {
+	"write", "zeroout", "discard", "secdiscard", "zero-range", "punch-hole", NULL };
+
+int wipe_hw_range(int fd, int mech, off_t offset, off_t len) {
+	uint64_t r[2] = {offset, len};
+	switch (mech) {
+		case WIPE_ZEROOUT: return ioctl(fd, BLKZEROOUT, r);
+		case WIPE_DISCARD: return ioctl(fd, BLKDISCARD, r);
+		case WIPE_SECDISCARD: return ioctl(fd, BLKSECDISCARD, r);
+		case WIPE_ZERO_RANGE:
+			return fallocate(fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, offset, len);
+		case WIPE_PUNCH_HOLE:
+			return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len); }
+	errno = EINVAL; return -1; }
 
-	void *block = malloc(bs);
-	if (!block) {
+// Returns true if remaining blocks from job->pos should be written normally
+bool wipe_hw(struct wipe_job *job) {
+	int *mech = job->mechs, res; off_t len; uint64_t ts;
+	for (off_t offset = job->begin; offset < job->end && !wipe_stop;) {
+		if (*mech == WIPE_WRITE) return true;
+		len = job->whole ? job->end - offset : wipe_block_len(job, offset);
+		wipe_ctl_take(job->ctl, 1, true);
+		ts = ts_us();
+		res = wipe_hw_range(job->fd, *mech, offset, len);
+		wipe_ctl_give(job->ctl, 1);
+		__atomic_add_fetch(&job->n_sys, 1, __ATOMIC_RELAXED);
+		if (res) {
+			if (errno == EOPNOTSUPP || errno == ENOTTY) { mech++; continue; }
+			job->err = errno; break; }
+		job->mechs_used |= 1 << *mech;
+		if (!job->whole) wipe_block_done(job, offset, ts);
+		else {
+			__atomic_add_fetch(&job->n, 1, __ATOMIC_RELAXED);
+			__atomic_store_n(&job->n_bytes, job->end - job->begin, __ATOMIC_RELAXED); }
+		offset += job->whole ? len : job->stride;
+		__atomic_store_n(&job->pos, offset, __ATOMIC_RELAXED); }
+	return false; }
+
+void *wipe_thread(void *arg) {
+	struct wipe_job *job = arg;
+	job->mechs_used = 0;
+	if ( (!job->mechs || job->verify || job->fill->type != FILL_ZERO || wipe_hw(job))
+			&& !job->err ) {
+		job->mechs_used |= 1 << WIPE_WRITE;
+		if (job->depth) wipe_uring(job); else wipe_loop(job); }
+	if (job->verify) wipe_verify_retire(job, 0, false);
+	pthread_mutex_lock(job->done_lock);
+	__atomic_store_n(&job->finished, true, __ATOMIC_RELEASE);
+	pthread_cond_signal(job->done_cond);
+	pthread_mutex_unlock(job->done_lock);
+	return NULL; }
+
+
+// Progress line with bytes covered, rate/ETA and write latency percentiles since last one
+// Different ts0 value indicates start of a new pass, with all job counters reset
+struct wipe_progress { uint64_t ts0, ts_last, lat_last[WIPE_LAT_BUCKETS]; off_t bytes_last, sys_last; };
+
+void wipe_progress( FILE *dst, struct wipe_progress *p,
+		char *prefix, struct wipe_job *jobs, int jn, uint64_t ts0 ) {
+	if (ts0 != p->ts0) *p = (struct wipe_progress) {.ts0=ts0, .ts_last=ts0};
+	uint64_t ts = ts_us(), lat[WIPE_LAT_BUCKETS] = {0}, lat_n = 0, lat_p[3] = {0};
+	off_t bytes = 0, total = 0, sys = 0;
+	for (int n = 0; n < jn; n++) {
+		bytes += __atomic_load_n(&jobs[n].n_bytes, __ATOMIC_RELAXED);
+		sys += __atomic_load_n(&jobs[n].n_sys, __ATOMIC_RELAXED);
+		total = jobs[n].end && total >= 0 ? total + jobs[n].end - jobs[n].begin : -1;
+		for (int m = 0; m < WIPE_LAT_BUCKETS; m++)
+			lat[m] += __atomic_load_n(&jobs[n].lat[m], __ATOMIC_RELAXED); }
+	for (int m = 0; m < WIPE_LAT_BUCKETS; m++) {
+		uint64_t c = lat[m]; lat[m] -= p->lat_last[m]; p->lat_last[m] = c; lat_n += lat[m]; }
+	for (uint64_t m = 0, c = 0; m < WIPE_LAT_BUCKETS; m++) {
+		if (!lat[m]) continue;
+		c += lat[m]; lat_p[2] = 1ULL << m;
+		if (!lat_p[0] && c * 100 >= lat_n * 50) lat_p[0] = 1ULL << m;
+		if (!lat_p[1] && c * 100 >= lat_n * 99) lat_p[1] = 1ULL << m; }
+	double rate = (double) (bytes - p->bytes_last) / (ts - p->ts_last + 1) * 1e6;
+	double rate_avg = (double) bytes / (ts - ts0 + 1) * 1e6;
+	double rate_sys = (double) (sys - p->sys_last) / (ts - p->ts_last + 1) * 1e6;
+	p->ts_last = ts; p->bytes_last = bytes; p->sys_last = sys;
+
+	// Line is formatted into buffer first, to not mix it up with other devices' output
+	char line[512]; int n = 0;
+	#define lprintf(...) if (n < sizeof(line)) n += snprintf(line + n, sizeof(line) - n, __VA_ARGS__)
+	lprintf("%sprogress: %'lld", prefix, (long long) bytes);
+	if (total > 0) { lprintf(" / %'lld B (%.1f%%)", (long long) total, 100.0 * bytes / total); }
+	else { lprintf(" B"); }
+	lprintf(", %.1f MB/s, %.0f syscalls/s (%'lld total)", rate / 1e6, rate_sys, (long long) sys);
+	if (total > 0 && rate_avg > 0) {
+		long long eta = (total - bytes) / rate_avg;
+		lprintf(", ETA %lld:%02lld:%02lld", eta / 3600, eta / 60 % 60, eta % 60); }
+	if (lat_n) { lprintf( ", latency p50/p99/max: <%'lld/%'lld/%'lld us",
+		(long long) lat_p[0], (long long) lat_p[1], (long long) lat_p[2] ); }
+	#undef lprintf
+	fprintf(dst, "%s\n", line); fflush(dst); }
+
+// Checkpoint file has header with wipe parameters, current pass number and seeds
+//  for random fills, and start/end/pos line for each region in the current pass
+// It's replaced atomically via rename(), and pos there is where all previous blocks are done
+int wipe_checkpoint_save( char *path, char *header,
+		int pass, struct wipe_fill *fills, int n_fills, struct wipe_job *jobs, int jn ) {
+	char path_tmp[strlen(path) + 5];
+	snprintf(path_tmp, sizeof(path_tmp), "%s.tmp", path);
+	FILE *dst = fopen(path_tmp, "w");
+	if (!dst) return -1;
+	fprintf(dst, "%s\npass %d", header, pass);
+	for (int n = 0; n < n_fills; n++) fprintf(dst, " %llx", (unsigned long long) fills[n].seed);
+	fprintf(dst, "\n");
+	for (int n = 0; n < jn; n++) {
+		off_t pos = __atomic_load_n(&jobs[n].pos, __ATOMIC_RELAXED);
+		if (jobs[n].end && pos > jobs[n].end) pos = jobs[n].end;
+		fprintf( dst, "%lld %lld %lld\n",
+			(long long) jobs[n].start, (long long) jobs[n].end, (long long) pos ); }
+	if (fflush(dst) || fsync(fileno(dst))) { fclose(dst); return -1; }
+	if (fclose(dst)) return -1;
+	return rename(path_tmp, path); }
+
+int wipe_checkpoint_load( char *path, char *header,
+		int *pass, struct wipe_fill *fills, int n_fills, struct wipe_job *jobs, int jn, off_t *pos ) {
+	FILE *src = fopen(path, "r");
+	if (!src) return -1;
+	char line[2048]; long long start, end, p; unsigned long long seed; int n = 0;
+	if ( !fgets(line, sizeof(line), src) || (line[strcspn(line, "\n")] = 0, strcmp(line, header))
+			|| fscanf(src, "pass %d", pass) != 1 || *pass < 0 || *pass >= n_fills ) {
+		fclose(src); errno = EINVAL; return -1; }
+	for (; n < n_fills && fscanf(src, "%llx", &seed) == 1; n++) fills[n].seed = seed;
+	if (n == n_fills) for (n = 0; n < jn && fscanf(src, "%lld %lld %lld", &start, &end, &p) == 3; n++) {
+		if (start != jobs[n].start || end != jobs[n].end || p < start) break;
+		pos[n] = p; }
+	fclose(src);
+	if (n < jn) { errno = EINVAL; return -1; }
+	return 0; }
+
+
+
+// Options shared by all devices
+struct wipe_opts {
+	int interval, bs, depth, jn, *mechs, ctl_limit;
+	bool direct, whole, unbounded, resume, verify, check_only, fill_random_any;
+	struct wipe_fill *fills; int n_fills;
+	int progress; FILE *progress_dst; char *checkpoint;
+} opts = {.interval=10, .bs=512, .depth=64};
+
+struct wipe_ctl *wipe_ctls = NULL;
+
+// State of one device, which runs all passes in its own thread when there are multiple
+struct wipe_dev {
+	char *path, *name, *checkpoint, checkpoint_header[1024];
+	int fd, fd_read, jn, pass, res; off_t size;
+	void *block; struct wipe_job *jobs; off_t *resume_pos; struct wipe_fill *fills;
+	struct wipe_progress progress; pthread_mutex_t done_lock; pthread_cond_t done_cond;
+	off_t n_bytes; uint64_t ts_start, ts_end; pthread_t thread; };
+
+// Controller key for grouping devices is last PCI address in their sysfs path
+//  (e.g. 0000:00:17.0 for SATA/SAS HBA or NVMe), or parent sysfs dir for virtual ones
+struct wipe_ctl *wipe_ctl_get(dev_t dev) {
+	char sysfs[64], key[256] = "", *path, *c;
+	unsigned a, b, d, f; int n;
+	snprintf(sysfs, sizeof(sysfs), "/sys/dev/block/%u:%u", major(dev), minor(dev));
+	if ((path = realpath(sysfs, NULL))) {
+		if ((c = strstr(path, "/block/"))) { *c = 0; snprintf(key, sizeof(key), "%s", path); *c = '/'; }
+		for (c = strtok(path, "/"); c; c = strtok(NULL, "/"))
+			if (sscanf(c, "%x:%x:%x.%x%n", &a, &b, &d, &f, &n) == 4 && !c[n])
+				snprintf(key, sizeof(key), "%s", c);
+		free(path); }
+	if (!*key) snprintf(key, sizeof(key), "%u:%u", major(dev), minor(dev));
+	struct wipe_ctl *ctl;
+	for (ctl = wipe_ctls; ctl; ctl = ctl->next) if (!strcmp(ctl->key, key)) return ctl;
+	if (!(ctl = calloc(1, sizeof(struct wipe_ctl)))) return NULL;
+	*ctl = (struct wipe_ctl) {.key=strdup(key), .avail=opts.ctl_limit, .next=wipe_ctls};
+	pthread_mutex_init(&ctl->lock, NULL); pthread_cond_init(&ctl->cond, NULL);
+	return wipe_ctls = ctl; }
+
+// Opens device, checks parameters and sets up jobs for it, returning exit code on errors
+int wipe_dev_init(struct wipe_dev *dev, bool multi) {
+	int bs = opts.bs, interval = opts.interval, depth = opts.depth, jn = opts.jn;
+	if (access(dev->path, opts.check_only ? R_OK : W_OK)) {
+		fprintf(stderr, "ERROR: access(%s) failed - %s\n", dev->path, strerror(errno));
+		return 33; }
+
+	dev->fd = open(dev->path, (opts.check_only ? O_RDONLY : O_WRONLY) | (opts.direct ? O_DIRECT : 0));
+	dev->fd_read = !opts.verify || opts.check_only ? dev->fd
+		: open(dev->path, O_RDONLY | (opts.direct ? O_DIRECT : 0));
+	if (dev->fd < 0 || dev->fd_read < 0) {
+		fprintf(stderr, "ERROR: open(%s) failed - %s\n", dev->path, strerror(errno));
+		return 33; }
+
+	// Single page-aligned zero/pattern block is shared by all writes, which O_DIRECT requires
+	// Its alignment is also checked against logical block size of the device here
+	int lbs = 0; off_t size = 0; struct stat st;
+	if (!fstat(dev->fd, &st)) {
+		if (S_ISBLK(st.st_mode)) {
+			if (ioctl(dev->fd, BLKSSZGET, &lbs)) lbs = 0;
+			if (ioctl(dev->fd, BLKGETSIZE64, &size)) size = 0; }
+		else { lbs = st.st_blksize; size = st.st_size; } }
+	if ( (opts.direct || (opts.mechs && S_ISBLK(st.st_mode)))
+			&& (!lbs || bs % lbs || ((off_t) interval * bs) % lbs) ) {
+		fprintf( stderr, "ERROR: O_DIRECT/ioctl block-size (%'d) and"
+			" interval (%'d x %'dB) must be multiples of device block size (%'d) [ %s ]\n",
+			bs, interval, bs, lbs, dev->path );
+		return 39; }
+	long page = sysconf(_SC_PAGESIZE), align = lbs > page ? lbs : page;
+	if (posix_memalign(&dev->block, align, bs)) {
 		fprintf(stderr, "ERROR: Failed to allocate %'dB - %s\n", bs, strerror(errno));
 		return 36; }
-	memset(block, 0, bs);
+	struct wipe_ctl *ctl = NULL;
+	if (opts.ctl_limit && !(ctl = wipe_ctl_get(S_ISBLK(st.st_mode) ? st.st_rdev : st.st_dev))) {
+		fprintf(stderr, "ERROR: Failed to allocate controller info - %s\n", strerror(errno));
+		return 36; }
+
+	// Regions are split on stride boundaries, to keep same pattern as with one thread
+	// Devices and files are wiped up to their size, for progress/ETA and errors
+	// Only -U without -j/-z does not use file size, and stops on first failed write
+	off_t stride = (off_t) bs * (interval + 1), strides = 0;
+	if (!opts.unbounded || jn || opts.mechs || S_ISBLK(st.st_mode)) {
+		if (!size) {
+			fprintf(stderr, "ERROR: Failed to get device size [ %s ]\n", dev->path);
+			return 41; }
+		strides = (size + stride - 1) / stride;
+		if (jn > strides) jn = strides; }
+	if (!jn) jn = 1;
+	dev->size = size; dev->jn = jn;
+	// Jobs signal device thread on exit, which waits with timeouts on same clock as ts_us()
+	pthread_condattr_t done_attr;
+	pthread_condattr_init(&done_attr); pthread_condattr_setclock(&done_attr, CLOCK_MONOTONIC);
+	pthread_mutex_init(&dev->done_lock, NULL); pthread_cond_init(&dev->done_cond, &done_attr);
+	if ( !(dev->jobs = calloc(jn, sizeof(struct wipe_job)))
+			|| !(dev->resume_pos = calloc(jn, sizeof(off_t)))
+			|| !(dev->fills = calloc(opts.n_fills, sizeof(struct wipe_fill))) ) {
+		fprintf(stderr, "ERROR: Failed to allocate job info - %s\n", strerror(errno));
+		return 36; }
+	memcpy(dev->fills, opts.fills, opts.n_fills * sizeof(struct wipe_fill));
+	struct wipe_job *jobs = dev->jobs;
+	for (int n = 0; n < jn; n++) {
+		jobs[n] = (struct wipe_job) {
+			.fd=dev->fd, .bs=bs, .depth=depth, .block=dev->block, .stride=stride,
+			.start=strides * n / jn * stride, .end=strides * (n + 1) / jn * stride,
+			.mechs=opts.mechs, .whole=opts.whole, .ctl=ctl,
+			.done_lock=&dev->done_lock, .done_cond=&dev->done_cond };
+		if (jobs[n].end > size) jobs[n].end = size;
+		if (depth && uring_init(&jobs[n].r, depth)) {
+			fprintf( stderr, "WARNING: io_uring setup failed,"
+				" using pwrite() loop - %s\n", strerror(errno) );
+			for (int m = 0; m < n; m++) close(jobs[m].r.fd);
+			for (int m = 0; m <= n; m++) jobs[m].depth = 0;
+			depth = 0; } }
+	for (int n = 0; n < jn; n++) {
+		if ( (depth && !(jobs[n].slots = calloc(depth, sizeof(struct wipe_slot))))
+				|| ( (opts.fill_random_any || opts.verify)
+					&& posix_memalign(&jobs[n].buff, align, (off_t) bs * (depth ? depth : 1)) ) ) {
+			fprintf(stderr, "ERROR: Failed to allocate per-thread buffers - %s\n", strerror(errno));
+			return 36; }
+		for (int m = 0; depth && (opts.fill_random_any || opts.verify) && m < depth; m++)
+			jobs[n].slots[m].buff = jobs[n].buff + (off_t) m * bs; }
 
-	off_t n = 0, n_bytes = 0, res;
-	int fd = open(argv[1], O_WRONLY);
-	lseek(fd, 0, SEEK_SET);
+	// Separate checkpoint file is used for each device, if there's more than one
+	if (opts.checkpoint) {
+		if (!multi) dev->checkpoint = opts.checkpoint;
+		else if (asprintf(&dev->checkpoint, "%s.%s", opts.checkpoint, dev->name) < 0) return 36; }
+	snprintf( dev->checkpoint_header, sizeof(dev->checkpoint_header),
+		"fast-disk-wipe checkpoint v2 bs=%d interval=%d size=%lld regions=%d fill=",
+		bs, interval, (long long) size, jn );
+	for (int n = 0; n < opts.n_fills; n++) {
+		char *spec = !strncmp(dev->fills[n].spec, "random", 6) ? "random" : dev->fills[n].spec;
+		if ( strlen(dev->checkpoint_header) + strlen(spec) + 2 < sizeof(dev->checkpoint_header) )
+			sprintf( dev->checkpoint_header + strlen(dev->checkpoint_header),
+				"%s%s", n ? "," : "", spec ); }
+	for (int n = 0; n < jn; n++) dev->resume_pos[n] = -1;
+	if (opts.resume) {
+		if (wipe_checkpoint_load( dev->checkpoint, dev->checkpoint_header,
+				&dev->pass, dev->fills, opts.n_fills, jobs, jn, dev->resume_pos )) {
+			fprintf( stderr, "ERROR: Failed to load checkpoint"
+				" for same device/parameters [ %s ] - %s\n", dev->checkpoint, strerror(errno) );
+			return 44; }
+		off_t n_done = 0;
+		for (int n = 0; n < jn; n++) n_done += dev->resume_pos[n] - jobs[n].start;
+		printf( "%s: resuming from checkpoint with %'lld bytes"
+			" already wiped in pass %d.\n", dev->path, (long long) n_done, dev->pass + 1 );
+		fflush(stdout); }
+	return 0; }
 
-	while (true) {
-		if (write(fd, block, bs) < bs) break;
-		n++; n_bytes += 1 * bs;
-		if ((res = lseek(fd, interval * bs, SEEK_CUR)) < 0) break;
-		n_bytes = res; }
+// Runs all wipe passes and verification for device, storing exit code in dev->res
+void *wipe_dev_run(void *arg) {
+	struct wipe_dev *dev = arg;
+	struct wipe_job *jobs = dev->jobs;
+	int jn = dev->jn, n_fills = opts.n_fills, pass = dev->pass;
+	dev->ts_start = ts_us();
+	if (opts.check_only) pass = n_fills;
+	for (; pass < n_fills + opts.verify && !wipe_stop && !dev->res; pass++) {
+		// Verification is done as an extra pass after all others, checking last fill
+		bool verify_pass = pass == n_fills;
+		struct wipe_fill *fill = dev->fills + (verify_pass ? n_fills - 1 : pass);
+		char label[64] = "", prefix[128] = "";
+		if (verify_pass) {
+			if (fill->type == FILL_RANDOM) snprintf( label, sizeof(label),
+				"verify random:%llx", (unsigned long long) fill->seed );
+			else snprintf(label, sizeof(label), "verify %s", fill->spec);
+			// Page cache is dropped for device, so that data is actually read from it
+			if (!opts.check_only && fsync(dev->fd))
+				fprintf(stderr, "WARNING: fsync before verification failed - %s\n", strerror(errno));
+			posix_fadvise(dev->fd_read, 0, 0, POSIX_FADV_DONTNEED); }
+		else if (n_fills > 1 || fill->type != FILL_ZERO) {
+			if (fill->type == FILL_RANDOM) snprintf( label, sizeof(label),
+				"pass %d/%d random:%llx", pass + 1, n_fills, (unsigned long long) fill->seed );
+			else snprintf(label, sizeof(label), "pass %d/%d %s", pass + 1, n_fills, fill->spec); }
+		if (dev->name || *label) snprintf( prefix, sizeof(prefix), "[%s%s%s] ",
+			dev->name ? dev->name : "", dev->name && *label ? " " : "", label );
+		fill_block(fill, dev->block, opts.bs);
+
+		// Start time is taken before any jobs run, as short ones can finish before thread loop below
+		uint64_t ts0 = ts_us(), ts_progress = ts0, ts_checkpoint = ts0, ts, ts_wake;
+		for (int n = 0; n < jn; n++) {
+			struct wipe_job *job = jobs + n;
+			job->fill = fill; job->n = job->n_bytes = job->n_sys = 0; job->err = 0; job->finished = false;
+			job->verify = verify_pass; job->fd = verify_pass ? dev->fd_read : dev->fd;
+			job->n_bad = 0; job->bad_start = -1; job->prefix = prefix;
+			memset(job->lat, 0, sizeof(job->lat));
+			job->begin = job->pos = dev->resume_pos[n] >= 0 ? dev->resume_pos[n] : job->start;
+			dev->resume_pos[n] = -1;
+			if ((errno = pthread_create(&job->thread, NULL, wipe_thread, job))) {
+				fprintf(stderr, "ERROR: Failed to start thread - %s\n", strerror(errno));
+				exit(38); } }
+
+		// Device thread only does progress/checkpoint updates until all jobs finish
+		// It sleeps until next update is due, or until woken up by a finished job
+		pthread_mutex_lock(&dev->done_lock);
+		while (true) {
+			bool finished = true;
+			for (int n = 0; n < jn; n++)
+				if (!__atomic_load_n(&jobs[n].finished, __ATOMIC_ACQUIRE)) finished = false;
+			if (finished) break;
+			ts_wake = UINT64_MAX;
+			if (opts.progress) ts_wake = ts_progress + opts.progress * 1000000ULL;
+			if (dev->checkpoint && !verify_pass && ts_checkpoint + 5000000ULL < ts_wake)
+				ts_wake = ts_checkpoint + 5000000ULL;
+			if (ts_wake == UINT64_MAX) pthread_cond_wait(&dev->done_cond, &dev->done_lock);
+			else {
+				struct timespec ts_abs = {.tv_sec=ts_wake / 1000000, .tv_nsec=ts_wake % 1000000 * 1000};
+				pthread_cond_timedwait(&dev->done_cond, &dev->done_lock, &ts_abs); }
+			ts = ts_us();
+			pthread_mutex_unlock(&dev->done_lock);
+			if (opts.progress && ts - ts_progress >= opts.progress * 1000000ULL) {
+				wipe_progress(opts.progress_dst, &dev->progress, prefix, jobs, jn, ts0); ts_progress = ts; }
+			if (dev->checkpoint && !verify_pass && ts - ts_checkpoint >= 5000000ULL) {
+				if (wipe_checkpoint_save( dev->checkpoint,
+						dev->checkpoint_header, pass, dev->fills, n_fills, jobs, jn ))
+					fprintf( stderr, "WARNING: Failed to save checkpoint"
+						" [ %s ] - %s\n", dev->checkpoint, strerror(errno) );
+				ts_checkpoint = ts; }
+			pthread_mutex_lock(&dev->done_lock); }
+		pthread_mutex_unlock(&dev->done_lock);
+		for (int n = 0; n < jn; n++) pthread_join(jobs[n].thread, NULL);
+		if (opts.progress) wipe_progress(opts.progress_dst, &dev->progress, prefix, jobs, jn, ts0);
+		if ( dev->checkpoint && !verify_pass && wipe_checkpoint_save(
+				dev->checkpoint, dev->checkpoint_header, pass, dev->fills, n_fills, jobs, jn ) ) {
+			fprintf( stderr, "ERROR: Failed to save checkpoint"
+				" [ %s ] - %s\n", dev->checkpoint, strerror(errno) );
+			dev->res = 44; }
+
+		off_t n_blocks = 0, n_bytes = 0, n_bad = 0; int n_whole = 0;
+		for (int n = 0; n < jn; n++) {
+			n_bytes += jobs[n].n_bytes; n_bad += jobs[n].n_bad;
+			// With -Z, each region is wiped either by one hw mechanism call or by strided writes
+			if (opts.whole && jobs[n].mechs_used && !(jobs[n].mechs_used & (1 << WIPE_WRITE))) n_whole++;
+			else n_blocks += jobs[n].n;
+			if (opts.mechs && !verify_pass && fill->type == FILL_ZERO) {
+				// Lists all mechanisms used for ranges in region, in same order as they were tried
+				char mech_list[128] = ""; int *mech = opts.mechs;
+				do if (jobs[n].mechs_used & (1 << *mech)) sprintf( mech_list + strlen(mech_list),
+					"%s%s", *mech_list ? ", " : "", wipe_mech_names[*mech] ); while (*(mech++));
+				printf( "%sRegion [%'lld - %'lld] wiped using: %s\n", prefix, (long long) jobs[n].start,
+					(long long) jobs[n].end, *mech_list ? mech_list : "-" ); }
+			if (!jobs[n].err) continue;
+			fprintf( stderr, "ERROR: %s%s failed in region [%'lld - %'lld] - %s\n",
+				prefix, verify_pass ? "Read" : "Write", (long long) jobs[n].start,
+				(long long) jobs[n].end, strerror(jobs[n].err) );
+			dev->res = 38; }
+		if (!verify_pass) dev->n_bytes += n_bytes;
+
+		if (wipe_stop) {
+			fprintf(stderr, "%sInterrupted, stopping early.\n", prefix);
+			if (!dev->res) dev->res = 45; }
+		if (verify_pass) {
+			printf( "%sVerified %'lld bytes with %'lld x %'dB blocks, %'lld mismatched.\n",
+				prefix, (long long) n_bytes, (long long) n_blocks, opts.bs, (long long) n_bad );
+			if (n_bad && !dev->res) dev->res = 47; }
+		else {
+			printf("%sFinished wiping %'lld bytes", prefix, (long long) n_bytes);
+			if (n_whole) printf(" in %'d region(s)", n_whole);
+			if (n_blocks || !n_whole) printf( "%s %'lld x %'dB blocks",
+				n_whole ? " and" : " with", (long long) n_blocks, opts.bs );
+			printf(".\n"); }
+		fflush(stdout); }
+	dev->ts_end = ts_us();
+	return NULL; }
+
+
+void print_usage(char *prog) {
+	printf( "Usage: %s [-q depth] [-D] [-j threads] [-z mechs] [-Z] [-U] [-f fill] [-p seconds] [-P fd]"
+		"\n  [-c checkpoint] [-r] [-V] [-C] [-Q depth] /dev/sdX [/dev/sdY ...] [interval=10] [bs=512]\n", prog );
+	printf("Writes 512B NUL-byte blocks to a device with 10-block intervals.\n");
+	printf("Multiple devices can be specified, to wipe those in parallel.\n");
+	printf("Files with all-digit names need e.g. ./ prefix, to not be parsed as interval/bs.\n\n");
+	printf("  -q depth - number of io_uring writes to keep in-flight (default: 64).\n");
+	printf("     Setting it to 0 or failing to init io_uring uses simple pwrite() loop.\n");
+	printf("  -D - use O_DIRECT writes, bypassing page cache.\n");
+	printf("     Block size and interval must be aligned to device logical block size.\n");
+	printf("  -j threads - split device into N contiguous regions, wiped in parallel.\n");
+	printf("     Same stride pattern is used, with per-thread io_uring queue depth.\n");
+	printf("  -z mechanism[,mechanism...] - try hw discard/zeroing before writes, in order.\n");
+	printf("     Mechanisms: zeroout, discard, secdiscard (BLK* ioctls for block devices),\n");
+	printf("      zero-range, punch-hole (fallocate for files or loop images).\n");
+	printf("     Each range falls back to next one if unsupported, and to writes after all.\n");
+	printf("     Note that discard does not guarantee that data becomes unreadable.\n");
+	printf("     Only used for passes with zero-fill (-f option).\n");
+	printf("  -Z - use -z mechanisms on whole regions instead of strided blocks.\n");
+	printf("  -U - for files, keep writing past their size until write fails (no -j/-z).\n");
+	printf("  -f fill[,fill...] - data to write, with multiple passes if more than one.\n");
+	printf("     Fills: zero (default), hex:<bytes> (e.g. hex:ff, repeated in each block),\n");
+	printf("      random[:seed] (counter-based PRNG, seed is hex, generated if missing).\n");
+	printf("  -p seconds - print progress with rate, ETA and latencies at specified interval.\n");
+	printf("  -P fd - file descriptor to print progress lines to (default: 2 - stderr).\n");
+	printf("  -c checkpoint - file to store wipe position in, updated every few seconds.\n");
+	printf("     With multiple devices, .<device-name> suffix is added for each one.\n");
+	printf("  -r - resume from checkpoint file (-c), which must be for same device/parameters.\n");
+	printf("  -V - verify that last fill landed, by reading same blocks back after all passes.\n");
+	printf("     Mismatched ranges are printed, and exit code is 47 if there are any of those.\n");
+	printf("     Without -D, page cache for device is dropped first, but it's less reliable.\n");
+	printf("  -C - same as -V, but only check blocks without writing anything.\n");
+	printf("  -Q depth - limit on total in-flight I/O for all devices on same controller/HBA.\n");
+	printf("     Devices are grouped by PCI address of the controller in their sysfs path.\n"); }
+
+int main(int argc, char *argv[]) {
+	char *prog = argv[0];
+	int opt, mechs[sizeof(wipe_mech_names) / sizeof(*wipe_mech_names)];
+	char *mech_names, *mech_name;
+	int progress_fd = 2;
+	char *fill_specs = "zero", *fill_spec;
+	while ((opt = getopt(argc, argv, "hq:Dj:z:ZUf:p:P:c:rVCQ:")) != -1) switch (opt) {
+		case 'q':
+			opts.depth = atoi(optarg);
+			if (opts.depth < 0 || (!opts.depth && strcmp(optarg, "0"))) {
+				fprintf(stderr, "ERROR: Failed to parse queue-depth value '%s'\n", optarg);
+				return 37; }
+			break;
+		case 'D': opts.direct = true; break;
+		case 'j':
+			if ((opts.jn = atoi(optarg)) <= 0) {
+				fprintf(stderr, "ERROR: Failed to parse thread-count value '%s'\n", optarg);
+				return 40; }
+			break;
+		case 'z': {
+			int *mech = opts.mechs = mechs; mech_names = optarg;
+			while ((mech_name = strsep(&mech_names, ","))) {
+				for (*mech = 1; wipe_mech_names[*mech]; (*mech)++)
+					if (!strcmp(mech_name, wipe_mech_names[*mech])) break;
+				if (!wipe_mech_names[*mech] || mech - mechs >= WIPE_PUNCH_HOLE) {
+					fprintf(stderr, "ERROR: Unrecognized -z mechanism '%s'\n", mech_name);
+					return 42; }
+				mech++; }
+			*mech = WIPE_WRITE; break; }
+		case 'Z': opts.whole = true; break;
+		case 'U': opts.unbounded = true; break;
+		case 'f': fill_specs = optarg; break;
+		case 'p':
+			if ((opts.progress = atoi(optarg)) <= 0) {
+				fprintf(stderr, "ERROR: Failed to parse progress interval '%s'\n", optarg);
+				return 43; }
+			break;
+		case 'P': progress_fd = atoi(optarg); break;
+		case 'c': opts.checkpoint = optarg; break;
+		case 'r': opts.resume = true; break;
+		case 'V': opts.verify = true; break;
+		case 'C': opts.verify = opts.check_only = true; break;
+		case 'Q':
+			if ((opts.ctl_limit = atoi(optarg)) <= 0) {
+				fprintf(stderr, "ERROR: Failed to parse controller queue-depth value '%s'\n", optarg);
+				return 37; }
+			break;
+		default: print_usage(prog); return -1; }
+	argc -= optind; argv += optind;
+
+	// Devices are all args up to first all-digit one, which are interval/bs,
+	//  so only files with all-digit names need some prefix like ./ to be recognized
+	int n_devs = 0;
+	while (n_devs < argc && strspn(argv[n_devs], "0123456789") != strlen(argv[n_devs])) n_devs++;
+	if (!n_devs || argc - n_devs > 2 || (opts.resume && !opts.checkpoint)) {
+		print_usage(prog); return -1; }
+	setlocale(LC_ALL, ""); // user selected locale
+
+	if (argc > n_devs && (opts.interval = atoi(argv[n_devs])) <= 0) {
+		fprintf(stderr, "ERROR: Failed to parse interval value '%s'\n", argv[n_devs]);
+		return 34; }
+	if (argc > n_devs + 1 && (opts.bs = atoi(argv[n_devs + 1])) <= 0) {
+		fprintf(stderr, "ERROR: Failed to parse block-size value '%s'\n", argv[n_devs + 1]);
+		return 35; }
+
+	opts.n_fills = 1;
+	for (char *c = fill_specs; *c; c++) if (*c == ',') opts.n_fills++;
+	struct wipe_fill fills[opts.n_fills];
+	opts.fills = fills;
+	fill_specs = strdup(fill_specs);
+	for (int n = 0; (fill_spec = strsep(&fill_specs, ",")); n++) {
+		if (fill_parse(fills + n, fill_spec)) {
+			fprintf(stderr, "ERROR: Failed to parse fill spec '%s'\n", fill_spec);
+			return 46; }
+		if (fills[n].type == FILL_RANDOM) opts.fill_random_any = true; }
+	struct wipe_fill *fill_last = fills + opts.n_fills - 1;
+	if (opts.check_only && fill_last->type == FILL_RANDOM && !strchr(fill_last->spec, ':')) {
+		fprintf(stderr, "ERROR: Random fill seed must be specified for check-only (-C) mode\n");
+		return 46; }
+
+	if (opts.progress && !(opts.progress_dst = fdopen(progress_fd, "w"))) {
+		fprintf(stderr, "ERROR: Failed to open progress fd %d - %s\n", progress_fd, strerror(errno));
+		return 43; }
+
+	struct wipe_dev devs[n_devs];
+	for (int n = 0; n < n_devs; n++) {
+		devs[n] = (struct wipe_dev) {.path=argv[n]};
+		if (n_devs > 1) {
+			devs[n].name = strrchr(argv[n], '/');
+			devs[n].name = devs[n].name ? devs[n].name + 1 : argv[n]; }
+		int res = wipe_dev_init(devs + n, n_devs > 1);
+		if (res) return res; }
+
+	struct sigaction sa = {.sa_handler=wipe_stop_handler, .sa_flags=SA_RESTART};
+	sigaction(SIGINT, &sa, NULL); sigaction(SIGTERM, &sa, NULL);
+
+	if (n_devs == 1) { wipe_dev_run(devs); return devs[0].res; }
+	for (int n = 0; n < n_devs; n++)
+		if ((errno = pthread_create(&devs[n].thread, NULL, wipe_dev_run, devs + n))) {
+			fprintf(stderr, "ERROR: Failed to start thread - %s\n", strerror(errno));
+			return 38; }
+	int res = 0;
+	for (int n = 0; n < n_devs; n++) pthread_join(devs[n].thread, NULL);
 
-	printf("Finished wiping %'d bytes with %'d x %'dB blocks.\n", n_bytes, n, bs);
-	return 0;
+	printf("Summary for %d devices:\n", n_devs);
+	for (int n = 0; n < n_devs; n++) {
+		struct wipe_dev *dev = devs + n;
+		double td = (dev->ts_end - dev->ts_start) / 1e6;
+		printf( "  %s: %'lld bytes in %.1fs (%.1f MB/s)", dev->path,
+			(long long) dev->n_bytes, td, td > 0 ? dev->n_bytes / td / 1e6 : 0 );
+		if (dev->res) printf(" - FAILED (exit code %d)\n", dev->res); else printf("\n");
+		if (!res) res = dev->res; }
+	return res;
 }
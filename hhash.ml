@@ -2,12 +2,14 @@
  *
  * Build with:
  *   % ocamlopt -o hhash -O2 unix.cmxa str.cmxa \
- *      -cclib -lsodium -ccopt -Wl,--no-as-needed hhash.ml hhash.ml.c
+ *      -cclib -lsodium -ccopt -pthread -ccopt -Wl,--no-as-needed hhash.ml hhash.ml.c
  *   % strip hhash
  *
  * Usage:
  *   % ./hhash some-fingerprint other-fp-string
  *   % ./hhash -e <<< file-contents
+ *   % find -print0 | ./hhash -0
+ *   % find -type f -print0 | ./hhash -0 -f
  * Debug: OCAMLRUNPARAM=b ./hhash ...
  *)
 
@@ -16,6 +18,10 @@ let cli_strip_re = ref "'s$"
 let cli_cache_file = ref "~/.cache/hhash.dict"
 let cli_entropy_est = ref false
 let cli_strings = ref []
+let cli_lines = ref false
+let cli_delim = ref '\n'
+let cli_files = ref false
+let cli_threads = ref 0
 let cli_word_count = ref 5
 let cli_dict_words_max = ref (int_of_float ((2. ** 30.) /. 10.)) (* ~1 GiB of ~10-char words *)
 
@@ -37,7 +43,18 @@ let () =
 				"-- File to store aspell cache into. Should be persistent for consistent outputs.\n" ^
 				"        Can be empty to re-run dict-dump cmd every time. Default: " ^ !cli_cache_file);
 			("-e", Arg.Set cli_entropy_est,
-				"-- Print entropy estimate for resulting hash value.") ]
+				"-- Print entropy estimate for resulting hash value.");
+			("--lines", Arg.Set cli_lines,
+				"-- Read newline-delimited records from stdin, and output word-hash for each one.\n" ^
+				"        Outputs are printed one per line, in same order, with buffered stdout.");
+			("-0", Arg.Unit (fun () -> cli_lines := true; cli_delim := '\000'),
+				"-- Same as --lines, but for NUL-delimited records on stdin.");
+			("-f", Arg.Set cli_files,
+				"-- Treat arguments (or --lines/-0 records on stdin) as paths of files to hash.\n" ^
+				"        Files are hashed in parallel (see -j), with outputs printed in same order.\n" ^
+				"        Empty line is printed for files that failed to be read, with error on stderr.");
+			("-j", Arg.Set_int cli_threads,
+				"-- Number of threads to hash files with, for -f option. Default: 0 = number of CPUs.") ]
 		(fun arg -> cli_strings :=  arg :: !cli_strings)
 		("Usage: " ^ Sys.argv.(0) ^ " [opts] [string ...]\
 			\n\nOutput word-hashes for each specified string(s) (same order, one per line), or use stdin if none are specified.\
@@ -45,11 +62,8 @@ let () =
 			\nThis is NOT cryptographic hash (wrt entropy, dsitribution, etc), and should not be used as such.\n")
 
 
-(* Build word_arr alphabet *)
-let word_count, word_bits, word_arr =
-	let cache_file = if Str.string_match (Str.regexp "^~/\\(.*\\)$") !cli_cache_file 0
-		then Sys.getenv "HOME" ^ "/" ^ (Str.matched_group 1 !cli_cache_file) else !cli_cache_file in
-
+(* Build word_arr alphabet from cache-file or dict-dump-command output *)
+let dict_load cache_file =
 	(* Lookup binary in PATH for Unix.open_process_args_in, if necessary *)
 	let dict_cmd = (String.split_on_char ' ' (String.trim !cli_dict_cmd)) in
 	let dict_cmd_bin = List.hd dict_cmd in
@@ -116,6 +130,82 @@ let word_count, word_bits, word_arr =
 	(n, n_bits, (Array.of_list words))
 
 
+(* Binary dict cache, mmap'ed to only read words that are used, all values are little-endian:
+ *   "hhdict" magic, u16 version, u32 dict word count, u32 word_arr length, f64 word-bits,
+ *   u32 strip-regexp length + regexp (-s option, as words depend on it),
+ *   u32 offsets for each word_arr entry + end offset, words blob *)
+let dict_bin_version = 2
+let dict_bin_hdr_len strip_re = 28 + String.length strip_re
+
+(* Written to per-process tmp file and renamed, so that concurrent runs don't clash *)
+(* Errors are ignored, as dict can be in a read-only dir, and word_arr is used from memory then *)
+let dict_bin_write path n n_bits word_arr =
+	let strip_re = !cli_strip_re in
+	let hdr_len = dict_bin_hdr_len strip_re in
+	let arr_len = Array.length word_arr in
+	let blob_len = Array.fold_left (fun len w -> len + String.length w) 0 word_arr in
+	let blob_pos = hdr_len + 4 * (arr_len + 1) in
+	let buf = Bytes.create (blob_pos + blob_len) in
+	Bytes.blit_string "hhdict" 0 buf 0 6;
+	Bytes.set_uint16_le buf 6 dict_bin_version;
+	Bytes.set_int32_le buf 8 (Int32.of_int n);
+	Bytes.set_int32_le buf 12 (Int32.of_int arr_len);
+	Bytes.set_int64_le buf 16 (Int64.bits_of_float n_bits);
+	Bytes.set_int32_le buf 24 (Int32.of_int (String.length strip_re));
+	Bytes.blit_string strip_re 0 buf 28 (String.length strip_re);
+	let pos = Array.fold_left (fun pos (k, w) ->
+			Bytes.set_int32_le buf (hdr_len + 4 * k) (Int32.of_int pos);
+			Bytes.blit_string w 0 buf (blob_pos + pos) (String.length w);
+			pos + String.length w )
+		0 (Array.mapi (fun k w -> (k, w)) word_arr) in
+	Bytes.set_int32_le buf (hdr_len + 4 * arr_len) (Int32.of_int pos);
+	let tmp = Printf.sprintf "%s.tmp.%d" path (Unix.getpid ()) in
+	try
+		let dst = open_out_bin tmp in
+		(try output_bytes dst buf; close_out dst with err -> close_out_noerr dst; raise err);
+		Sys.rename tmp path
+	with Sys_error _ | Unix.Unix_error _ -> (try Sys.remove tmp with Sys_error _ -> ())
+
+let dict_bin_load path =
+	let data =
+		let fd = Unix.openfile path [Unix.O_RDONLY] 0 in
+		Fun.protect ~finally:(fun () -> Unix.close fd) (fun () -> Bigarray.array1_of_genarray
+			(Unix.map_file fd Bigarray.char Bigarray.c_layout false [|-1|])) in
+	let len = Bigarray.Array1.dim data in
+	let u8 pos = int_of_char (Bigarray.Array1.get data pos) in
+	let u32 pos = (u8 pos) lor ((u8 (pos+1)) lsl 8) lor ((u8 (pos+2)) lsl 16) lor ((u8 (pos+3)) lsl 24) in
+	let fail msg = raise (HHash_fail (Printf.sprintf "%s [ %s ]" msg path)) in
+	if len < dict_bin_hdr_len "" || String.init 6 (Bigarray.Array1.get data) <> "hhdict"
+		|| ((u8 6) lor ((u8 7) lsl 8)) <> dict_bin_version then fail "Unrecognized binary dict cache";
+	let n = u32 8 and arr_len = u32 12 and strip_len = u32 24 in
+	let n_bits = Int64.float_of_bits (Int64.logor
+		(Int64.of_int (u32 16)) (Int64.shift_left (Int64.of_int (u32 20)) 32)) in
+	if len < 28 + strip_len || String.init strip_len
+			(fun m -> Bigarray.Array1.get data (28 + m)) <> !cli_strip_re
+		then fail "Binary dict cache is for different strip-regexp";
+	let hdr_len = dict_bin_hdr_len !cli_strip_re in
+	let blob_pos = hdr_len + 4 * (arr_len + 1) in
+	if len < blob_pos || len < blob_pos + (u32 (blob_pos - 4)) then fail "Truncated binary dict cache";
+	let word_get k =
+		let a = u32 (hdr_len + 4 * k) and b = u32 (hdr_len + 4 * (k+1)) in
+		String.init (b - a) (fun m -> Bigarray.Array1.get data (blob_pos + a + m)) in
+	(n, n_bits, arr_len, word_get)
+
+(* Binary cache is used when it's newer than text one and for same -s option, re-generated otherwise *)
+let word_count, word_bits, word_arr_len, word_get =
+	let cache_file = if Str.string_match (Str.regexp "^~/\\(.*\\)$") !cli_cache_file 0
+		then Sys.getenv "HOME" ^ "/" ^ (Str.matched_group 1 !cli_cache_file) else !cli_cache_file in
+	let cache_bin = if cache_file = "" then "" else cache_file ^ ".bin" in
+	let cache_bin_valid = cache_bin <> "" &&
+		try (Unix.stat cache_bin).Unix.st_mtime >= (Unix.stat cache_file).Unix.st_mtime
+		with Unix.Unix_error _ -> false in
+	try if not cache_bin_valid then raise Not_found else dict_bin_load cache_bin
+	with Not_found | HHash_fail _ | Unix.Unix_error _ ->
+		let n, n_bits, word_arr = dict_load cache_file in
+		if cache_bin <> "" then dict_bin_write cache_bin n n_bits word_arr;
+		(n, n_bits, Array.length word_arr, Array.get word_arr)
+
+
 let read_byte_iter_func s =
 	let n = ref 0 in let n_max = Bytes.length s in
 	(fun () -> if !n < n_max
@@ -123,7 +213,7 @@ let read_byte_iter_func s =
 
 let hash_to_words read_byte =
 	let n_bits = int_of_float (* n_bits here will be int with padded array *)
-		((log (float_of_int (Array.length word_arr))) /. (log 2.)) in
+		((log (float_of_int word_arr_len)) /. (log 2.)) in
 	let rec read_input hash n bits =
 		let b =
 			try int_of_char (read_byte ())
@@ -142,7 +232,7 @@ let hash_to_words read_byte =
 				then read_input (n :: hash) b (n_bits - rem)
 				else read_input hash n bits in
 	let hash = List.tl (read_input [] 0 n_bits) in (* always drop final word *)
-	List.map (fun n -> Array.get word_arr n) hash
+	List.map word_get hash
 
 let hash_str read_byte = String.concat " " (hash_to_words read_byte)
 let hash_print read_byte = Printf.printf "%s\n%!" (hash_str read_byte)
@@ -150,14 +240,60 @@ let hash_print read_byte = Printf.printf "%s\n%!" (hash_str read_byte)
 
 external hash_raw : string -> int -> bytes = "mls_hash_string"
 external hash_raw_stdin : int -> bytes = "mls_hash_stdin"
+external hash_raw_into : string -> bytes -> unit = "mls_hash_string_into"
+external hash_raw_files : string array -> int -> int -> bytes array * string array = "mls_hash_files"
+
+(* Reads next delimited record from stdin into buf, returning false on EOF *)
+let rec read_record buf = match input_char stdin with
+	| c when c = !cli_delim -> true
+	| c -> Buffer.add_char buf c; read_record buf
+	| exception End_of_file -> Buffer.length buf > 0
+
+(* Reads delimited records from stdin, hashing each one into same bytes buffer *)
+let hash_print_records hash_len =
+	let hash = Bytes.create hash_len and buf = Buffer.create 256 in
+	set_binary_mode_in stdin true;
+	while read_record buf do
+		hash_raw_into (Buffer.contents buf) hash; Buffer.clear buf;
+		print_string (hash_str (read_byte_iter_func hash)); print_char '\n'
+	done;
+	flush stdout
+
+(* Files are hashed by a pool of native threads in C, without OCaml runtime lock *)
+let files_failed = ref 0
+let files_batch = 4096 (* paths from stdin to hash before printing results *)
+
+let hash_print_files hash_len paths =
+	let hashes, errs = hash_raw_files paths hash_len !cli_threads in
+	Array.iteri (fun n hash ->
+		if errs.(n) = "" then print_string (hash_str (read_byte_iter_func hash)) else (
+			files_failed := !files_failed + 1;
+			Printf.eprintf "hhash: failed to hash file [ %s ]: %s\n%!" paths.(n) errs.(n) );
+		print_char '\n' ) hashes;
+	flush stdout
+
+let hash_print_file_records hash_len =
+	let buf = Buffer.create 256 in
+	let rec read_batch paths n =
+		if n >= files_batch || not (read_record buf) then paths else (
+			let p = Buffer.contents buf in Buffer.clear buf; read_batch (p :: paths) (n + 1) ) in
+	let rec hash_batches () = match read_batch [] 0 with
+		| [] -> ()
+		| paths -> hash_print_files hash_len (Array.of_list (List.rev paths)); hash_batches () in
+	set_binary_mode_in stdin true;
+	hash_batches ()
 
 let () =
-	let n = float_of_int (Array.length word_arr) in
+	let n = float_of_int word_arr_len in
 	let n_bits = int_of_float ((log n) /. (log 2.)) in
 	let hash_bits = !cli_word_count * n_bits in
 	(* hash_len gets +1 because last incomplete word is always dropped *)
 	let hash_len = (int_of_float (floor ((float_of_int hash_bits) /. 8.))) + 1 in
-	if (List.length !cli_strings) > 0
+	if !cli_files then (
+		if !cli_lines then hash_print_file_records hash_len
+		else hash_print_files hash_len (Array.of_list (List.rev !cli_strings)) )
+	else if !cli_lines then hash_print_records hash_len
+	else if (List.length !cli_strings) > 0
 		then List.iter (fun s ->
 			let hash = hash_raw s hash_len in
 			hash_print (read_byte_iter_func hash)) !cli_strings
@@ -167,3 +303,5 @@ let () =
 	if not !cli_entropy_est then () else Printf.printf
 		"entropy-stats: word-count=%d dict-words=%d word-bits=%.1f total-bits=%.1f\n"
 		!cli_word_count word_count word_bits ((float_of_int !cli_word_count) *. word_bits)
+
+let () = if !files_failed > 0 then exit 1
@@ -1,11 +1,18 @@
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 #include <caml/mlvalues.h>
 #include <caml/memory.h>
 #include <caml/alloc.h>
 #include <caml/fail.h>
+#include <caml/signals.h>
 
 // Note: int return values of crypto_generichash funcs seem to be undocumented
 #include <sodium.h>
@@ -14,12 +21,20 @@
 char *key = "hhash.1";
 int key_len = 7;
 
-int block_size = 2^16;
+#define HASH_BUFF_SIZE (1 << 20)
+char *hash_buff = NULL; // read() buffer for stdin, allocated outside of OCaml heap
+
+// sodium_init() is safe to call multiple times, but isn't free, so is only done once
+int hash_init_done = 0;
+void hash_init(void) {
+	if (hash_init_done) return;
+	if (sodium_init() < 0) caml_failwith("sodium_init failed");
+	hash_init_done = 1; }
 
 
 value mls_hash_string(value v_str, value v_hash_len) {
 	CAMLparam2(v_str, v_hash_len);
-	if (sodium_init() < 0) caml_failwith("sodium_init failed");
+	hash_init();
 
 	int hash_len = Int_val(v_hash_len);
 	if (!hash_len) hash_len = crypto_generichash_BYTES;
@@ -33,28 +48,141 @@ value mls_hash_string(value v_str, value v_hash_len) {
 	CAMLreturn(v_bs);
 }
 
+// Same as mls_hash_string, but writes hash into pre-allocated bytes of hash_len, for batches
+value mls_hash_string_into(value v_str, value v_hash) {
+	CAMLparam2(v_str, v_hash);
+	hash_init();
+	int hash_len = caml_string_length(v_hash);
+	if (hash_len > crypto_generichash_BYTES_MAX) caml_invalid_argument("hash length is too large");
+	(void) crypto_generichash( Bytes_val(v_hash), hash_len,
+		Bytes_val(v_str), caml_string_length(v_str), key, key_len );
+	CAMLreturn(Val_unit);
+}
+
+
+// Hashes all data from fd, returning errno value on failure
+// Regular files are mmap'ed from current position, others read in HASH_BUFF_SIZE blocks
+// Doesn't touch OCaml heap, so should be called without holding the runtime lock
+int hash_fd(int fd, char *buff, unsigned char *hash, int hash_len) {
+	crypto_generichash_state state;
+	(void) crypto_generichash_init(&state, key, key_len, hash_len);
+
+	struct stat st; off_t pos;
+	if ( !fstat(fd, &st) && S_ISREG(st.st_mode)
+			&& (pos = lseek(fd, 0, SEEK_CUR)) >= 0 && st.st_size > pos ) {
+		off_t offset = pos - pos % sysconf(_SC_PAGESIZE);
+		size_t len = st.st_size - offset;
+		char *data = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, offset);
+		if (data != MAP_FAILED) {
+			(void) madvise(data, len, MADV_SEQUENTIAL);
+			(void) crypto_generichash_update(&state, data + (pos - offset), st.st_size - pos);
+			munmap(data, len);
+			// Any data appended after fstat() will be read below
+			if (lseek(fd, st.st_size, SEEK_SET) < 0) return errno; } }
+
+	ssize_t res;
+	while ((res = read(fd, buff, HASH_BUFF_SIZE))) {
+		if (res < 0) { if (errno == EINTR) continue; return errno; }
+		(void) crypto_generichash_update(&state, buff, res); }
+	(void) crypto_generichash_final(&state, hash, hash_len);
+	return 0; }
+
 
 value mls_hash_stdin(value v_hash_len) {
 	CAMLparam1(v_hash_len);
-	if (sodium_init() < 0) caml_failwith("sodium_init failed");
+	CAMLlocal1(v_bs);
+	hash_init();
 
 	int hash_len = Int_val(v_hash_len);
 	if (!hash_len) hash_len = crypto_generichash_BYTES;
-	value v_bs = caml_alloc_string(hash_len);
-	char *hash = Bytes_val(v_bs);
+	if (hash_len > crypto_generichash_BYTES_MAX) caml_invalid_argument("hash length is too large");
+	unsigned char hash[crypto_generichash_BYTES_MAX];
+	if (!hash_buff && !(hash_buff = malloc(HASH_BUFF_SIZE))) caml_raise_out_of_memory();
+
+	caml_enter_blocking_section();
+	int err = hash_fd(0, hash_buff, hash, hash_len);
+	caml_leave_blocking_section();
+	if (err) {
+		char msg[128];
+		snprintf(msg, sizeof(msg), "Failed to read stdin: %s", strerror(err));
+		caml_failwith(msg); }
+
+	v_bs = caml_alloc_string(hash_len);
+	memcpy(Bytes_val(v_bs), hash, hash_len);
+	CAMLreturn(v_bs);
+}
 
-	crypto_generichash_state state;
-	(void) crypto_generichash_init(&state, key, key_len, hash_len);
 
-	int res;
-	char *block = Bytes_val(caml_alloc_string(block_size));
-	while (1) {
-		res = (int) read(0, block, block_size);
-		block[res] = '\0';
-		if (!res) break;
-		(void) crypto_generichash_update(&state, block, res); }
-	(void) crypto_generichash_final(&state, hash, hash_len);
+// Parallel hashing of files - paths/results are copied outside of OCaml heap,
+//  so that worker threads can run without the runtime lock,
+//  picking next file index from a shared atomic counter until all are done.
+struct hash_files_job {
+	char **paths; unsigned char *hashes; int *errs;
+	int count, hash_len, next; };
+
+void *hash_files_worker(void *arg) {
+	struct hash_files_job *job = arg;
+	char *buff = malloc(HASH_BUFF_SIZE);
+	int n, fd;
+	while ((n = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->count) {
+		if (job->errs[n]) continue;
+		if (!buff) { job->errs[n] = ENOMEM; continue; }
+		if ((fd = open(job->paths[n], O_RDONLY | O_CLOEXEC)) < 0) { job->errs[n] = errno; continue; }
+		job->errs[n] = hash_fd(fd, buff, job->hashes + n * job->hash_len, job->hash_len);
+		close(fd); }
+	free(buff);
+	return NULL; }
+
+value mls_hash_files(value v_paths, value v_hash_len, value v_threads) {
+	CAMLparam3(v_paths, v_hash_len, v_threads);
+	CAMLlocal4(v_res, v_hashes, v_errs, v_s);
+	hash_init();
 
-	// for (int n=0; n < hash_len; n++) hash[n] = '\xff';
-	CAMLreturn(v_bs);
+	int hash_len = Int_val(v_hash_len);
+	if (!hash_len) hash_len = crypto_generichash_BYTES;
+	if (hash_len > crypto_generichash_BYTES_MAX) caml_invalid_argument("hash length is too large");
+	int count = Wosize_val(v_paths), threads = Int_val(v_threads);
+	if (threads <= 0) threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads > count) threads = count;
+	if (threads < 1) threads = 1;
+
+	struct hash_files_job job = {.count=count, .hash_len=hash_len};
+	job.paths = calloc(count + 1, sizeof(char *));
+	job.hashes = malloc((count + 1) * hash_len);
+	job.errs = calloc(count + 1, sizeof(int));
+	pthread_t *tids = calloc(threads, sizeof(pthread_t));
+	int n, err = !job.paths || !job.hashes || !job.errs || !tids;
+	for (n = 0; !err && n < count; n++) {
+		v_s = Field(v_paths, n);
+		if (!caml_string_is_c_safe(v_s)) { job.errs[n] = EINVAL; continue; }
+		if (!(job.paths[n] = strdup(String_val(v_s)))) err = 1; }
+	if (err) {
+		for (n = 0; job.paths && n < count; n++) free(job.paths[n]);
+		free(job.paths); free(job.hashes); free(job.errs); free(tids);
+		caml_raise_out_of_memory(); }
+
+	caml_enter_blocking_section();
+	// Current thread is used as one of the workers, and pool can be smaller if pthread_create fails
+	int tn;
+	for (tn = 1; tn < threads; tn++)
+		if (pthread_create(&tids[tn], NULL, hash_files_worker, &job)) break;
+	hash_files_worker(&job);
+	while (--tn > 0) pthread_join(tids[tn], NULL);
+	caml_leave_blocking_section();
+
+	v_hashes = caml_alloc(count, 0);
+	v_errs = caml_alloc(count, 0);
+	for (n = 0; n < count; n++) {
+		v_s = caml_alloc_string(hash_len);
+		memcpy(Bytes_val(v_s), job.hashes + n * hash_len, hash_len);
+		Store_field(v_hashes, n, v_s);
+		v_s = caml_copy_string(job.errs[n] ? strerror(job.errs[n]) : "");
+		Store_field(v_errs, n, v_s); }
+	v_res = caml_alloc_tuple(2);
+	Store_field(v_res, 0, v_hashes);
+	Store_field(v_res, 1, v_errs);
+
+	for (n = 0; n < count; n++) free(job.paths[n]);
+	free(job.paths); free(job.hashes); free(job.errs); free(tids);
+	CAMLreturn(v_res);
 }
@@ -7,24 +7,36 @@
 */
 
 /*
-	LD_PRELOAD library to override bind() and sendto(),
+	LD_PRELOAD library to override bind(), connect(), sendto(),
+		sendmsg(), sendmmsg() and close(),
 		forcing bind() to use specific options depending on env vars:
 
 	- MNB_IPV4=1.2.3.4 - specified IPv4 address.
+	- MNB_IPV6=2001:db8::1 - specified IPv6 address.
 	- MNB_PORT=34730 - specified port.
+	- MNB_PORT_RANGE=34730-34799 - claim free port from this range for each socket.
+		Used ports are tracked in a shm_open() segment shared by all processes
+			of same uid that use same range, and released on close() or exit.
 	- MNB_REUSE_ADDR=1 - SO_REUSEADDR option - socket(7).
 	- MNB_REUSE_PORT=1 - SO_REUSEPORT option - socket(7).
-	- MNB_IP_TRANSPARENT=1 - IP_TRANSPARENT option - ip(7).
+	- MNB_IP_TRANSPARENT=1 - IP_TRANSPARENT/IPV6_TRANSPARENT option - ip(7), ipv6(7).
 
 	Limitations (hacks):
-	- Only binds IPv4 (AF_INET) sockets.
-	- Tracks last fd used in sendto(fd, ...) and does bind() for it once.
+	- Only binds IPv4/IPv6 (AF_INET/AF_INET6) sockets, with MNB_PORT used for both.
+	- Does bind() once for each UDP (SOCK_DGRAM) fd used in
+		connect/sendto/sendmsg/sendmmsg(fd, ...) with IPv4/IPv6 destination address,
+		tracking that (and other socket types to skip) in a per-fd state table,
+		which is sized by RLIMIT_NOFILE and cleared on close().
+		Only explicit bind() calls are changed for TCP and other non-datagram sockets.
+	- fds closed via dup2() or without close() from libc are not tracked.
+	- Failed bind() before connect() or send*() makes it fail with same errno,
+		except for EINVAL (already bound), which is only reported on stderr.
 
 	Here to force mosh-client to connect from specified local port.
 
 	Compile on Linux (>=3.9) with:
 		gcc -nostartfiles -fpic -shared \
-			-ldl -D_GNU_SOURCE mosh-nat-bind.c -o mnb.so
+			-ldl -lrt -D_GNU_SOURCE mosh-nat-bind.c -o mnb.so
 
 	Usage example relevant to mosh-client:
 		MNB_PORT=34731 LD_PRELOAD=./mnb.so \
@@ -34,8 +46,14 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <dlfcn.h>
@@ -43,41 +61,120 @@
 
 
 int (*real_bind)(int, const struct sockaddr *, socklen_t);
+int (*real_connect)(int, const struct sockaddr *, socklen_t);
 int (*real_sendto)( int fd, const void *message,
 	size_t length, int flags, const struct sockaddr *sk, socklen_t dest_len );
+ssize_t (*real_sendmsg)(int, const struct msghdr *, int);
+int (*real_sendmmsg)(int, struct mmsghdr *, unsigned int, int);
+int (*real_close)(int);
 
 unsigned long int bind_addr_saddr = 0;
-struct sockaddr_in local_sockaddr_in[] = { 0 };
+struct in6_addr bind_addr6_saddr;
+int bind_addr6 = 0;
 
 unsigned int bind_port_saddr = 0;
 unsigned int reuse_port = 0;
 unsigned int reuse_addr = 0;
 unsigned int ip_transparent = 0;
 
-int bind_last_fd = -1;
+// Per-fd state table, with one byte for each fd number up to RLIMIT_NOFILE
+// Only updated via atomic ops, so that sendto() hot path is one load for any thread
+#define MNB_FD_BOUND 1
+#define MNB_FD_SKIP 2 // not a datagram socket
+unsigned char *fd_state = NULL;
+size_t fd_state_len = 0;
 
+// Returns non-zero if caller should bind() fd, marking it as bound for others
+int fd_state_claim(int fd) {
+	if (fd < 0 || (size_t) fd >= fd_state_len) return 1; // untracked fd
+	if (__atomic_load_n(&fd_state[fd], __ATOMIC_ACQUIRE)) return 0;
+	return !__atomic_exchange_n(&fd_state[fd], MNB_FD_BOUND, __ATOMIC_ACQ_REL); }
+
+void fd_state_set(int fd, unsigned char state) {
+	if (fd < 0 || (size_t) fd >= fd_state_len) return;
+	__atomic_store_n(&fd_state[fd], state, __ATOMIC_RELEASE); }
+
+
+// Port pool for MNB_PORT_RANGE - shared between processes via mmap'ed shm segment,
+//  with owner pid in each port slot, which is claimed/released via atomic CAS.
+// Slots owned by pids that no longer exist are reclaimed, so SIGKILL doesn't leak ports.
+pid_t *port_pool = NULL;
+unsigned int port_pool_lo = 0, port_pool_n = 0;
+unsigned short *fd_port = NULL; // pool port that each fd is bound to, if any
+
+int port_pool_init(const char *range) {
+	unsigned int lo, hi; char name[64];
+	if (sscanf(range, "%u-%u", &lo, &hi) != 2 || !lo || lo > hi || hi > 65535)
+		{ errno = EINVAL; return -1; }
+	snprintf(name, sizeof(name), "/mnb.ports.%u-%u.%u", lo, hi, getuid());
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0) return -1;
+	size_t len = (hi - lo + 1) * sizeof(pid_t);
+	pid_t *pool = MAP_FAILED;
+	if (!ftruncate(fd, len)) pool = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	real_close(fd);
+	if (pool == MAP_FAILED) return -1;
+	if (fd_state_len && !(fd_port = calloc(fd_state_len, sizeof(unsigned short)))) return -1;
+	port_pool = pool; port_pool_lo = lo; port_pool_n = hi - lo + 1;
+	return 0; }
+
+// Returns first free port starting from n-th slot, or 0 if all are taken
+unsigned int port_pool_claim(unsigned int n) {
+	pid_t pid = getpid(), owner;
+	for (unsigned int m = 0; m < port_pool_n; m++, n++) {
+		n %= port_pool_n;
+		owner = __atomic_load_n(&port_pool[n], __ATOMIC_ACQUIRE);
+		if (owner && (owner == pid || !kill(owner, 0) || errno != ESRCH)) continue;
+		if (__atomic_compare_exchange_n( &port_pool[n],
+			&owner, pid, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED )) return port_pool_lo + n; }
+	return 0; }
+
+void port_pool_release(unsigned int port) {
+	pid_t pid = getpid();
+	__atomic_compare_exchange_n( &port_pool[port - port_pool_lo],
+		&pid, 0, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED ); }
+
+
+#define dlsym_real(name) \
+	real_##name = dlsym(RTLD_NEXT, #name); \
+	if ((err = dlerror()) != NULL) fprintf(stderr, "dlsym (" #name "): %s\n", err);
 
 void _init(void){
 	const char *err;
 
-	real_bind = dlsym(RTLD_NEXT, "bind");
-	if ((err = dlerror()) != NULL) fprintf(stderr, "dlsym (bind): %s\n", err);
-	real_sendto = dlsym(RTLD_NEXT, "sendto");
-	if ((err = dlerror()) != NULL) fprintf(stderr, "dlsym (sendto): %s\n", err);
+	dlsym_real(bind);
+	dlsym_real(connect);
+	dlsym_real(sendto);
+	dlsym_real(sendmsg);
+	dlsym_real(sendmmsg);
+	dlsym_real(close);
+
+	// Hard limit is used if sane, as soft one can be raised by the app later
+	struct rlimit rl;
+	if (!getrlimit(RLIMIT_NOFILE, &rl)) {
+		fd_state_len = rl.rlim_cur;
+		if (rl.rlim_max != RLIM_INFINITY && rl.rlim_max <= (1 << 24)) fd_state_len = rl.rlim_max;
+		if (fd_state_len > (1 << 24)) fd_state_len = 1 << 24;
+		if (!(fd_state = calloc(fd_state_len, 1))) fd_state_len = 0; }
 
 	char *bind_addr_env;
-	if ((bind_addr_env = getenv("MNB_IPV4"))) {
+	if ((bind_addr_env = getenv("MNB_IPV4")))
 		bind_addr_saddr = inet_addr(bind_addr_env);
-		local_sockaddr_in->sin_family = AF_INET;
-		local_sockaddr_in->sin_addr.s_addr = bind_addr_saddr;
-		local_sockaddr_in->sin_port = htons(0);
+
+	char *bind_addr6_env;
+	if ((bind_addr6_env = getenv("MNB_IPV6"))) {
+		bind_addr6 = inet_pton(AF_INET6, bind_addr6_env, &bind_addr6_saddr) == 1;
+		if (!bind_addr6) fprintf(stderr, "mnb: failed to parse MNB_IPV6 address: %s\n", bind_addr6_env);
 	}
 
 	char *bind_port_env;
-	if ((bind_port_env = getenv("MNB_PORT"))) {
+	if ((bind_port_env = getenv("MNB_PORT")))
 		bind_port_saddr = atoi(bind_port_env);
-		local_sockaddr_in->sin_port = htons(bind_port_saddr);
-	}
+
+	char *port_range_env;
+	if ((port_range_env = getenv("MNB_PORT_RANGE")) && port_pool_init(port_range_env))
+		fprintf( stderr, "mnb: failed to setup MNB_PORT_RANGE"
+			" pool [ %s ]: %s\n", port_range_env, strerror(errno) );
 
 	char *reuse_addr_env;
 	if ((reuse_addr_env = getenv("MNB_REUSE_ADDR")))
@@ -92,37 +189,117 @@ void _init(void){
 		ip_transparent = atoi(ip_transparent_env);
 }
 
-int bind(int fd, const struct sockaddr *sk, socklen_t sl) {
-	static struct sockaddr_in *lsk_in;
-	lsk_in = (struct sockaddr_in *)sk;
+// Releases all pool ports claimed by this process on exit
+void _fini(void) {
+	if (!port_pool) return;
+	pid_t pid = getpid();
+	for (unsigned int n = 0; n < port_pool_n; n++)
+		if (__atomic_load_n(&port_pool[n], __ATOMIC_ACQUIRE) == pid)
+			port_pool_release(port_pool_lo + n);
+}
 
-	if (bind_addr_saddr) lsk_in->sin_addr.s_addr = bind_addr_saddr;
-	if (bind_port_saddr) lsk_in->sin_port = htons(bind_port_saddr);
+// Returns non-zero if local addr/port should be forced for sockets of that family
+int bind_family(int family) {
+	if (family == AF_INET) return bind_addr_saddr || bind_port_saddr || port_pool;
+	if (family == AF_INET6) return bind_addr6 || bind_port_saddr || port_pool;
+	return 0; }
+
+int bind(int fd, const struct sockaddr *sk, socklen_t sl) {
+	// Caller's sockaddr is copied, as it can be const or reused by the app
+	struct sockaddr_storage lsk;
+	in_port_t *lsk_port = NULL;
+	if (sk && sl <= sizeof(lsk) && bind_family(sk->sa_family)) {
+		memcpy(&lsk, sk, sl);
+		if (sk->sa_family == AF_INET && sl >= sizeof(struct sockaddr_in)) {
+			struct sockaddr_in *lsk_in = (struct sockaddr_in *) &lsk;
+			if (bind_addr_saddr) lsk_in->sin_addr.s_addr = bind_addr_saddr;
+			if (bind_port_saddr) lsk_in->sin_port = htons(bind_port_saddr);
+			lsk_port = &lsk_in->sin_port;
+			sk = (struct sockaddr *) &lsk; }
+		else if (sk->sa_family == AF_INET6 && sl >= sizeof(struct sockaddr_in6)) {
+			struct sockaddr_in6 *lsk_in6 = (struct sockaddr_in6 *) &lsk;
+			if (bind_addr6) lsk_in6->sin6_addr = bind_addr6_saddr;
+			if (bind_port_saddr) lsk_in6->sin6_port = htons(bind_port_saddr);
+			lsk_port = &lsk_in6->sin6_port;
+			sk = (struct sockaddr *) &lsk; } }
 
 	if (reuse_addr)
 		setsockopt( fd, SOL_SOCKET,
 			SO_REUSEADDR, &reuse_addr, sizeof(reuse_addr) );
 	if (reuse_port)
 		setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &reuse_port, sizeof(reuse_port));
-	if (ip_transparent)
+	if (ip_transparent && sk && sk->sa_family == AF_INET6)
+		setsockopt( fd, SOL_IPV6,
+			IPV6_TRANSPARENT, &ip_transparent, sizeof(ip_transparent) );
+	else if (ip_transparent)
 		setsockopt( fd, SOL_IP,
 			IP_TRANSPARENT, &ip_transparent, sizeof(ip_transparent) );
 
-	return real_bind(fd, sk, sl);
+	int res, err;
+	if (port_pool && lsk_port) {
+		// Ports in use by something outside of the pool are skipped as well
+		unsigned int port, n = getpid() % port_pool_n, tries = port_pool_n;
+		while (1) {
+			if (!(port = port_pool_claim(n))) { errno = EADDRINUSE; return -1; }
+			*lsk_port = htons(port);
+			if (!(res = real_bind(fd, sk, sl))) break;
+			err = errno; port_pool_release(port); errno = err;
+			if (err != EADDRINUSE || !--tries) return res;
+			n = port - port_pool_lo + 1; }
+		if (fd_port && (size_t) fd < fd_state_len)
+			__atomic_store_n(&fd_port[fd], port, __ATOMIC_RELEASE); }
+	else res = real_bind(fd, sk, sl);
+
+	if (!res) fd_state_set(fd, MNB_FD_BOUND);
+	return res;
+}
+
+// Binds UDP fd before first connect/send to dst, returning -1 if that fails
+// Only dst address family and socket type are checked here, and bind() above sets addr/port
+int bind_dst(int fd, const struct sockaddr *dst) {
+	if (!dst || !bind_family(dst->sa_family) || !fd_state_claim(fd)) return 0;
+	int type; socklen_t type_len = sizeof(type);
+	if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &type_len) || type != SOCK_DGRAM) {
+		fd_state_set(fd, MNB_FD_SKIP); return 0; }
+	struct sockaddr_storage lsk = {.ss_family=dst->sa_family};
+	socklen_t sl = dst->sa_family == AF_INET6 ?
+		sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+	if (!bind(fd, (struct sockaddr *) &lsk, sl)) return 0;
+	// EINVAL = socket is already bound, e.g. implicitly by earlier send()
+	if (errno != EINVAL) { fd_state_set(fd, 0); return -1; }
+	if ((size_t) fd < fd_state_len)
+		fprintf(stderr, "mnb: failed to bind fd %d: %s\n", fd, strerror(errno));
+	fd_state_set(fd, MNB_FD_BOUND);
+	return 0; }
+
+int close(int fd) {
+	fd_state_set(fd, 0);
+	int res = real_close(fd);
+	if (fd_port && fd >= 0 && (size_t) fd < fd_state_len) {
+		unsigned short port = __atomic_exchange_n(&fd_port[fd], 0, __ATOMIC_ACQ_REL);
+		if (port) port_pool_release(port); }
+	return res;
+}
+
+int connect(int fd, const struct sockaddr *sk, socklen_t sl) {
+	if (bind_dst(fd, sk)) return -1;
+	return real_connect(fd, sk, sl);
 }
 
 ssize_t sendto(
 		int fd, const void *message, size_t length,
 		int flags, const struct sockaddr *sk, socklen_t dest_len ) {
-	static struct sockaddr_in *rsk_in;
-	rsk_in = (struct sockaddr_in *)sk;
-
-	if (bind_last_fd != fd) {
-		bind_last_fd = fd;
-		if ( (rsk_in->sin_family == AF_INET)
-				&& (bind_addr_saddr || bind_port_saddr) )
-			bind(fd, (struct sockaddr *)local_sockaddr_in, sizeof (struct sockaddr));
-	}
-
+	if (bind_dst(fd, sk)) return -1;
 	return real_sendto(fd, message, length, flags, sk, dest_len);
 }
+
+ssize_t sendmsg(int fd, const struct msghdr *msg, int flags) {
+	if (msg && bind_dst(fd, msg->msg_name)) return -1;
+	return real_sendmsg(fd, msg, flags);
+}
+
+// Socket is bound once for the whole batch, so it's still sent by one syscall
+int sendmmsg(int fd, struct mmsghdr *msgvec, unsigned int vlen, int flags) {
+	if (msgvec && vlen && bind_dst(fd, msgvec[0].msg_hdr.msg_name)) return -1;
+	return real_sendmmsg(fd, msgvec, vlen, flags);
+}
@@ -1,22 +1,32 @@
 // Safer "rm" tool for restricting all file removals to a specific dir.
-// Build: gcc -Wall -O2 -o rmx rmx.c && strip rmx
+// Build: gcc -Wall -O2 -pthread -o rmx rmx.c && strip rmx
 // Usage info: ./rmx -h
 
 #include <fcntl.h>
+#include <dirent.h>
 #include <linux/openat2.h>
+#include <linux/io_uring.h>
 #include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
 #include <limits.h>
 #include <libgen.h>
 #include <errno.h>
 #include <err.h>
+#include <pthread.h>
+#include <time.h>
 
 
+#define RMX_CHUNK 10000 // default max number of paths to validate/remove at once from stdin
+
 void print_usage(char *prog, int code) {
-	printf("Usage: %s [-h/--help] [-d <dir>] [-x] [-f/--force] [--] <files...>\n\n", prog);
+	printf( "Usage: %s [-h/--help] [-d <dir>] [-x] [-f/--force]"
+		" [-q <depth>] [-r] [-j <threads>]\n   [-0] [--stdin] [-c <count>] [-n/--dry-run] [--stats] [--] [files...]\n\n", prog );
 	printf(
 		"Remove specified files like rm(1) tool does, with additional\n"
 		" safety options to reliably restrict all removals to be under specified directory:\n\n"
@@ -34,77 +44,440 @@ void print_usage(char *prog, int code) {
 		"      will still be reported and set non-zero exit code, but won't stop operation.\n"
 		"     Normally everything stops immediately at any detected error otherwise.\n\n"
 
-		"  -h/--help - print this usage info.\n\n" );
+		"  -q <depth> - Remove files in batches via io_uring, with up to <depth> unlinks in-flight.\n"
+		"     Useful for removing huge file lists, as kernel can process those in parallel.\n"
+		"     Error for any file stops new submissions, but in-flight ones still complete,\n"
+		"      and all errors are reported. Default is to call unlinkat() for each file in order.\n\n"
+
+		"  -r - Remove directories with all their contents.\n"
+		"     Each subdirectory is opened via openat2(RESOLVE_BENEATH|RESOLVE_NO_SYMLINKS)\n"
+		"      from its parent fd (plus RESOLVE_NO_XDEV with -x), so that removal can't escape\n"
+		"      specified dir, symlinks there are never followed, and -x mountpoints crossed.\n"
+		"  -j <threads> - Number of threads to remove subdirectories with in -r mode. Default: 4\n\n"
+
+		"  --stdin - Read newline-delimited file paths from stdin, instead of arguments.\n"
+		"     Paths are processed in chunks (see -c option), with all paths in a chunk\n"
+		"      validated before removing any files, and chunk errors stopping everything.\n"
+		"  -0 - Same as --stdin, but with NUL-delimited paths, e.g. from \"find ... -print0\".\n"
+		"  -c <count> - Max number of paths in a chunk for --stdin/-0 modes. Default: %d\n\n"
+
+		"  -n/--dry-run - Print paths of all files/dirs that would be removed, one per line.\n"
+		"     Runs all same validation and directory walks (with -r), but doesn't remove anything,\n"
+		"      checking file types, dir write permissions and sticky bit instead,\n"
+		"      and reports errors for all paths instead of stopping at first unlink error.\n"
+		"  --stats - Print number of syscalls of each type, dir fds opened,\n"
+		"      and time spent validating/removing paths to stderr on exit.\n\n"
+
+		"  -h/--help - print this usage info.\n\n", RMX_CHUNK );
 	exit(code); }
 
 
+// Syscall counters for --stats, updated atomically from all threads
+struct rmx_stats {
+	unsigned long realpath, openat2, dir_fds, unlinkat, getdents;
+	double td_validate, td_remove; } rmx_stats;
+#define rmx_stat(k) __atomic_add_fetch(&rmx_stats.k, 1, __ATOMIC_RELAXED)
+
+bool rmx_dry_run = false; // --dry-run - unlinkat() only checks that removal can work
+
+double rmx_ts(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9; }
+
+void rmx_stats_print(void) {
+	fflush(stdout);
+	fprintf( stderr, "Stats:\n  realpath() calls: %lu\n"
+			"  openat2() calls: %lu (dir fds opened: %lu)\n"
+			"  unlinkat() calls: %lu%s\n  getdents64() calls: %lu\n"
+			"  validation time: %.3fs\n  removal time: %.3fs\n",
+		rmx_stats.realpath, rmx_stats.openat2, rmx_stats.dir_fds, rmx_stats.unlinkat,
+		rmx_dry_run ? " (dry-run fstatat/faccessat checks)" : "", rmx_stats.getdents,
+		rmx_stats.td_validate, rmx_stats.td_remove ); }
+
 // Example: openat2(dir_fd, path, .flags=O_RDONLY, .resolve=RESOLVE_NO_SYMLINKS);
 #define openat2(dir_fd, path, ...) rmx_openat2(dir_fd, path, (struct open_how){__VA_ARGS__});
 int rmx_openat2(int dir_fd, const char* path, struct open_how how) {
-	return syscall(SYS_openat2, dir_fd, path, &how, sizeof(struct open_how)); }
+	int fd = syscall(SYS_openat2, dir_fd, path, &how, sizeof(struct open_how));
+	rmx_stat(openat2); if (fd >= 0) rmx_stat(dir_fds);
+	return fd; }
+
+// Same as unlinkat(), but only checks file type and dir permissions in dry-run mode
+// Sticky-bit check uses euid=0 in place of CAP_FOWNER, and doesn't account for other caps/LSMs
+int rmx_unlinkat(int dir_fd, char *name, int flags) {
+	struct stat st, dir_st;
+	rmx_stat(unlinkat);
+	if (!rmx_dry_run) return unlinkat(dir_fd, name, flags);
+	if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW)) return -1;
+	if (!(flags & AT_REMOVEDIR) && S_ISDIR(st.st_mode)) { errno = EISDIR; return -1; }
+	if ((flags & AT_REMOVEDIR) && !S_ISDIR(st.st_mode)) { errno = ENOTDIR; return -1; }
+	if (faccessat(dir_fd, ".", W_OK|X_OK, AT_EACCESS)) return -1;
+	if (fstat(dir_fd, &dir_st)) return -1;
+	uid_t uid = geteuid();
+	if ( (dir_st.st_mode & S_ISVTX) && uid
+			&& uid != st.st_uid && uid != dir_st.st_uid ) { errno = EPERM; return -1; }
+	return 0; }
+
+
+// Hash table of validated dir fds, keyed by resolved dir path relative to base-dir
+// Entries are refcounted by files in them, and fds get closed after last one is removed
+struct rmx_dir { char *path; int fd, refs; bool base; struct rmx_dir *next; };
+struct rmx_dirs { struct rmx_dir **buckets; unsigned mask; };
+
+void rmx_dirs_init(struct rmx_dirs *dirs, int count) {
+	for (dirs->mask = 15; dirs->mask < count && dirs->mask < (1 << 24) - 1;)
+		dirs->mask = (dirs->mask << 1) | 1;
+	if (!(dirs->buckets = calloc(dirs->mask + 1, sizeof(struct rmx_dir *))))
+		err(1, "ERROR: Failed to allocate dir-fd table"); }
+
+// Returns existing entry or opens new dir fd with specified resolve flags, NULL on errors
+struct rmx_dir *rmx_dir_get( struct rmx_dirs *dirs,
+		char *path, int base_fd, int resolve ) {
+	unsigned h = 2166136261u; // FNV-1a
+	for (char *c = path; *c; c++) h = (h ^ (unsigned char) *c) * 16777619u;
+	struct rmx_dir **bucket = dirs->buckets + (h & dirs->mask), *d;
+	for (d = *bucket; d; d = d->next) if (!strcmp(d->path, path)) break;
+	if (!d) {
+		int fd = !*path ? base_fd :
+			openat2(base_fd, path, .flags=O_RDONLY|O_DIRECTORY, .resolve=resolve);
+		if (fd < 0) return NULL;
+		if (!(d = calloc(1, sizeof(struct rmx_dir))) || !(d->path = strdup(path)))
+			err(1, "ERROR: Failed to allocate dir-fd table entry");
+		d->fd = fd; d->base = !*path; d->next = *bucket; *bucket = d; }
+	else if (!d->refs && !d->base) { // all files there were already removed
+		int fd = openat2(base_fd, path, .flags=O_RDONLY|O_DIRECTORY, .resolve=resolve);
+		if (fd < 0) return NULL;
+		d->fd = fd; }
+	d->refs++; return d; }
+
+void rmx_dir_put(struct rmx_dir *d) {
+	if (!--d->refs && !d->base) close(d->fd); }
+
+void rmx_dirs_clear(struct rmx_dirs *dirs) {
+	for (unsigned n = 0; n <= dirs->mask; n++) {
+		for (struct rmx_dir *d = dirs->buckets[n], *dn; d; d = dn) {
+			if (d->refs && !d->base) close(d->fd);
+			dn = d->next; free(d->path); free(d); }
+		dirs->buckets[n] = NULL; } }
+
+
+// Minimal raw-syscall io_uring wrapper, to avoid liburing dependency
+struct rmx_uring {
+	int fd;
+	unsigned *sq_tail, *sq_mask, *sq_array, *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes; };
+
+int rmx_uring_init(struct rmx_uring *r, unsigned depth) {
+	struct io_uring_params p = {0};
+	if ((r->fd = syscall(SYS_io_uring_setup, depth, &p)) < 0) return -1;
+	// IORING_OP_UNLINKAT is from 5.11, and this feature flag is from 5.12
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NATIVE_WORKERS)) {
+		close(r->fd); errno = EOPNOTSUPP; return -1; }
+
+	size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (cq_len > sq_len) sq_len = cq_len;
+	void *sq = mmap( NULL, sq_len, PROT_READ|PROT_WRITE,
+		MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQ_RING );
+	void *sqes = mmap( NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+		PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQES );
+	if (sq == MAP_FAILED || sqes == MAP_FAILED) { close(r->fd); return -1; }
+
+	r->sq_tail = sq + p.sq_off.tail; r->sq_mask = sq + p.sq_off.ring_mask;
+	r->sq_array = sq + p.sq_off.array;
+	r->cq_head = sq + p.cq_off.head; r->cq_tail = sq + p.cq_off.tail;
+	r->cq_mask = sq + p.cq_off.ring_mask; r->cqes = sq + p.cq_off.cqes;
+	r->sqes = sqes;
+	return 0; }
+
+void rmx_uring_unlinkat(struct rmx_uring *r, int dir_fd, char *name, int idx) {
+	unsigned tail = *r->sq_tail, n = tail & *r->sq_mask;
+	struct io_uring_sqe *sqe = &r->sqes[n];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_UNLINKAT; sqe->fd = dir_fd;
+	sqe->addr = (unsigned long) name; sqe->user_data = idx;
+	rmx_stat(unlinkat);
+	r->sq_array[n] = n;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE); }
+
+struct rmx_ctx {
+	char *dir_check; int dir_fd, dir_offset, open_resolve, depth, threads; bool force, recursive;
+	struct rmx_dirs dirs; struct rmx_uring r;
+	struct rmx_dir **file_dirs; char **file_names, **file_bufs, **file_paths; };
+
+
+// Recursive removal (-r option) runs thread pool on a shared stack of dirs to scan
+// Each dir is opened with RESOLVE_BENEATH from its parent fd, which stays open until
+//  all subdirs are removed, and is removed itself after last pending subdir is done
+// Stack is LIFO, so that number of open dir fds is about tree depth x threads
+struct rmx_node { struct rmx_node *parent, *next; int parent_fd, fd, pending; char name[]; };
+
+struct rmx_tree {
+	char *path; int resolve, active, res; bool force;
+	struct rmx_node *stack; pthread_mutex_t lock; pthread_cond_t cond; };
+
+struct linux_dirent64 {
+	unsigned long long d_ino; long long d_off;
+	unsigned short d_reclen; unsigned char d_type; char d_name[]; };
+
+void rmx_tree_fail(struct rmx_tree *t, char *name, int e) {
+	if (t->force && e == ENOENT) return;
+	warnx("ERROR: Failed to remove [ %s ] under [ %s ]: %s", name, t->path, strerror(e));
+	pthread_mutex_lock(&t->lock);
+	t->res |= 4; pthread_cond_broadcast(&t->cond);
+	pthread_mutex_unlock(&t->lock); }
+
+// Prints path of node or an entry in it (name != NULL) for dry-run mode
+void rmx_tree_print(struct rmx_tree *t, struct rmx_node *node, char *name) {
+	flockfile(stdout);
+	char *names[PATH_MAX / 2]; int n = 0;
+	for (; node->parent->parent && n < PATH_MAX / 2; node = node->parent) names[n++] = node->name;
+	fputs(t->path, stdout);
+	while (n > 0) printf("/%s", names[--n]);
+	if (name) printf("/%s", name);
+	putchar('\n'); funlockfile(stdout); }
+
+void rmx_tree_push(struct rmx_tree *t, struct rmx_node *parent, char *name) {
+	struct rmx_node *node = malloc(sizeof(struct rmx_node) + strlen(name) + 1);
+	if (!node) err(1, "ERROR: Failed to allocate dir info");
+	*node = (struct rmx_node) {.parent=parent, .parent_fd=parent->fd, .fd=-1, .pending=1};
+	strcpy(node->name, name);
+	__atomic_add_fetch(&parent->pending, 1, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&t->lock);
+	node->next = t->stack; t->stack = node; pthread_cond_signal(&t->cond);
+	pthread_mutex_unlock(&t->lock); }
+
+// Drops reference to dir, removing it and releasing its parent, if it was the last one
+void rmx_tree_done(struct rmx_tree *t, struct rmx_node *node) {
+	struct rmx_node *parent;
+	while (node && !__atomic_sub_fetch(&node->pending, 1, __ATOMIC_ACQ_REL)) {
+		if (node->fd >= 0) {
+			close(node->fd);
+			if (__atomic_load_n(&t->res, __ATOMIC_RELAXED)) {}
+			else if (rmx_unlinkat(node->parent_fd, node->name, AT_REMOVEDIR))
+				rmx_tree_fail(t, node->name, errno);
+			else if (rmx_dry_run) rmx_tree_print(t, node, NULL); }
+		parent = node->parent; free(node); node = parent; } }
+
+void rmx_tree_scan(struct rmx_tree *t, struct rmx_node *node, char *buff, int buff_len) {
+	node->fd = openat2( node->parent_fd, node->name,
+		.flags=O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC, .resolve=t->resolve );
+	if (node->fd < 0) { rmx_tree_fail(t, node->name, errno); rmx_tree_done(t, node); return; }
+	long n;
+	while (!__atomic_load_n(&t->res, __ATOMIC_RELAXED)) {
+		rmx_stat(getdents);
+		if ((n = syscall(SYS_getdents64, node->fd, buff, buff_len)) <= 0) {
+			if (n < 0) rmx_tree_fail(t, node->name, errno);
+			break; }
+		for (long pos = 0; pos < n;) {
+			struct linux_dirent64 *d = (void *) (buff + pos); pos += d->d_reclen;
+			if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, "..")) continue;
+			// DT_UNKNOWN or dir replaced by something else are handled same as other entries
+			if (d->d_type == DT_DIR) rmx_tree_push(t, node, d->d_name);
+			else if (rmx_unlinkat(node->fd, d->d_name, 0)) {
+				if (errno == EISDIR) rmx_tree_push(t, node, d->d_name);
+				else rmx_tree_fail(t, d->d_name, errno); }
+			else if (rmx_dry_run) rmx_tree_print(t, node, d->d_name); } }
+	rmx_tree_done(t, node); }
+
+void *rmx_tree_worker(void *arg) {
+	struct rmx_tree *t = arg;
+	char buff[32768];
+	bool skip;
+	pthread_mutex_lock(&t->lock);
+	while (true) {
+		while (!t->stack && t->active) pthread_cond_wait(&t->cond, &t->lock);
+		if (!t->stack) break;
+		struct rmx_node *node = t->stack; t->stack = node->next; t->active++;
+		skip = t->res;
+		pthread_mutex_unlock(&t->lock);
+		// After any error, remaining dirs are only released, closing parent fds without removal
+		if (skip) rmx_tree_done(t, node); else rmx_tree_scan(t, node, buff, sizeof(buff));
+		pthread_mutex_lock(&t->lock);
+		if (!--t->active && !t->stack) pthread_cond_broadcast(&t->cond); }
+	pthread_cond_broadcast(&t->cond);
+	pthread_mutex_unlock(&t->lock);
+	return NULL; }
+
+// Removes dir with all its contents, using ctx->threads workers, returning res bits
+int rmx_tree_remove(struct rmx_ctx *ctx, int dir_fd, char *name, char *path) {
+	if (!strcmp(name, ".") || !strcmp(name, "..") || !strcmp(name, "/")) {
+		warnx("ERROR: Refusing to remove dir by special name [ %s ]", path); return 4; }
+	struct rmx_tree t = { .path=path, .force=ctx->force,
+		.resolve=ctx->open_resolve | RESOLVE_BENEATH,
+		.lock=PTHREAD_MUTEX_INITIALIZER, .cond=PTHREAD_COND_INITIALIZER };
+	struct rmx_node root = {.fd=dir_fd, .pending=1};
+	rmx_tree_push(&t, &root, name);
+	pthread_t threads[ctx->threads];
+	int n = 1;
+	for (; n < ctx->threads; n++)
+		if ((errno = pthread_create(threads + n, NULL, rmx_tree_worker, &t))) {
+			warn("WARNING: Failed to start thread"); break; }
+	rmx_tree_worker(&t);
+	while (--n > 0) pthread_join(threads[n], NULL);
+	return t.res; }
+
+
+// Unlinks files with up to depth operations in-flight, returning res bits for errors
+// Stops submitting new unlinks after first error, unless it's ENOENT with force=true
+int rmx_unlink_uring(struct rmx_ctx *ctx, int count) {
+	struct rmx_uring *r = &ctx->r;
+	int res = 0, n = 0, n_submit, ret, m;
+	unsigned inflight = 0, head;
+	struct io_uring_cqe *cqe;
+	while (true) {
+		for (n_submit = 0; !res && n < count && inflight + n_submit < ctx->depth; n++, n_submit++)
+			rmx_uring_unlinkat(r, ctx->file_dirs[n]->fd, ctx->file_names[n], n);
+		if (!n_submit && !inflight) break;
+		do ret = syscall( SYS_io_uring_enter, r->fd,
+			n_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0 );
+		while (ret < 0 && errno == EINTR);
+		if (ret < 0) err(res | 4, "ERROR: io_uring_enter failed");
+		inflight += n_submit;
+		while ((head = *r->cq_head) != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+			cqe = &r->cqes[head & *r->cq_mask]; m = cqe->user_data;
+			if (cqe->res == -EISDIR && ctx->recursive) res |= rmx_tree_remove(
+				ctx, ctx->file_dirs[m]->fd, ctx->file_names[m], ctx->file_paths[m] );
+			else if (cqe->res < 0 && !(ctx->force && cqe->res == -ENOENT)) {
+				warnx( "ERROR: Failed to remove file [ %s ]: %s",
+					ctx->file_paths[m], strerror(-cqe->res) );
+				res |= 4; }
+			rmx_dir_put(ctx->file_dirs[m]);
+			__atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE); inflight--; } }
+	return res; }
+
+
+// Validates all paths in a chunk, and removes files if there were no errors
+// Returns res bits for any errors there, exiting on non-batched unlink errors
+int rmx_chunk(struct rmx_ctx *ctx, char **paths, int count) {
+	// Same unresolved dirname as for previous file is skipped, as its entry was validated
+	int res = 0, idx = 0;
+	double ts = rmx_ts();
+	// dirname() can return static string or pointer into its arg, so latter is used for free()
+	struct rmx_dir *dir_last = NULL; char *dir_last_raw = NULL, *dir_last_buf = NULL;
+	for (int n = 0; n < count; n++) {
+		char *p = paths[n], *p_buf = strdup(p), *p_dir_buf = strdup(p);
+		if (!p_buf || !p_dir_buf) err(1, "ERROR: Failed to allocate path buffers");
+		char *p_dir_raw = dirname(p_dir_buf);
+		if (dir_last && !strcmp(p_dir_raw, dir_last_raw)) {
+			free(p_dir_buf); dir_last->refs++;
+			ctx->file_dirs[idx] = dir_last; ctx->file_bufs[idx] = p_buf;
+			ctx->file_paths[idx] = p; ctx->file_names[idx++] = basename(p_buf); continue; }
+		char *p_dir_real = realpath(p_dir_raw, NULL), *p_dir = p_dir_real;
+		rmx_stat(realpath);
+		if (!p_dir) {
+			if (!(ctx->force && errno == ENOENT)) {
+				warn("ERROR: File-dir access error [ %s ]", p); res |= 1; }
+			free(p_buf); free(p_dir_buf); continue; }
+
+		if (ctx->dir_check) {
+			if ( strncmp(p_dir, ctx->dir_check, ctx->dir_offset)
+					|| (p_dir[ctx->dir_offset] != '/' && p_dir[ctx->dir_offset] != 0) ) {
+				warnx("ERROR: Path is not inside base-dir [ %s ]", p);
+				free(p_buf); free(p_dir_buf); free(p_dir_real);
+				res |= 2; continue; }
+			p_dir = strlen(p_dir) > ctx->dir_offset + 1 ? p_dir + ctx->dir_offset + 1 : ""; }
+
+		struct rmx_dir *d = rmx_dir_get(&ctx->dirs, p_dir, ctx->dir_fd, ctx->open_resolve);
+		if (!d && !(ctx->force && errno == ENOENT)) {
+			warn("ERROR: File-dir access error [ %s ]", p); res |= 1; }
+		free(p_dir_real);
+		if (!d) { free(p_buf); free(p_dir_buf); continue; }
+		free(dir_last_buf); dir_last_buf = p_dir_buf; dir_last_raw = p_dir_raw; dir_last = d;
+		ctx->file_dirs[idx] = d; ctx->file_bufs[idx] = p_buf;
+		ctx->file_paths[idx] = p; ctx->file_names[idx++] = basename(p_buf); }
+	free(dir_last_buf);
+	rmx_stats.td_validate += rmx_ts() - ts; ts = rmx_ts();
+
+	// Dry-run reports all errors, as nothing gets removed and they don't affect each other
+	if (!res) {
+		if (ctx->depth) res = rmx_unlink_uring(ctx, idx);
+		else for (int n = 0; n < idx; n++) {
+			if (rmx_unlinkat(ctx->file_dirs[n]->fd, ctx->file_names[n], 0)) {
+				if (errno == EISDIR && ctx->recursive) {
+					if ( (res |= rmx_tree_remove( ctx, ctx->file_dirs[n]->fd,
+						ctx->file_names[n], ctx->file_paths[n] )) && !rmx_dry_run ) exit(res); }
+				else if (ctx->force && errno == ENOENT) {}
+				else if (!rmx_dry_run)
+					err(res | 4, "ERROR: Failed to remove file [ %s ]", ctx->file_paths[n]);
+				else { warn("ERROR: Failed to remove file [ %s ]", ctx->file_paths[n]); res |= 4; } }
+			else if (rmx_dry_run) printf("%s\n", ctx->file_paths[n]);
+			rmx_dir_put(ctx->file_dirs[n]); } }
+	rmx_stats.td_remove += rmx_ts() - ts;
+	for (int n = 0; n < idx; n++) free(ctx->file_bufs[n]);
+	rmx_dirs_clear(&ctx->dirs);
+	return res; }
 
 int main(int argc, char *argv[]) {
 	if (argc <= 1) print_usage(argv[0], 1);
 
-	int idx = 0;
-	int file_dir_fds[argc-1];
-	char *file_names[argc-1];
-	char *file_paths[argc-1];
-
-	char *dir_check = NULL;
-	bool dev_check = false, force = false, args = false;
+	struct rmx_ctx ctx = {.open_resolve=RESOLVE_NO_SYMLINKS, .threads=4};
+	bool dev_check = false, args = false, use_stdin = false;
+	int chunk = RMX_CHUNK, idx = 0, delim = '\n';
+	char **file_paths = argv + 1; // args are compacted in-place
 	for (int n = 1; n < argc; n++) {
 		char *p = argv[n];
 		if (!args) {
 			if (!strcmp(p, "-h") || !strcmp(p, "--help")) print_usage(argv[0], 0);
-			if (!strcmp(p, "-d")) { dir_check = argv[++n]; continue; }
+			if (!strcmp(p, "-d")) { ctx.dir_check = argv[++n]; continue; }
 			if (!strcmp(p, "-x")) { dev_check = true; continue; }
-			if (!strcmp(p, "-f")) { force = true; continue; }
+			if (!strcmp(p, "-f") || !strcmp(p, "--force")) { ctx.force = true; continue; }
+			if (!strcmp(p, "-q") && n + 1 < argc) {
+				if ((ctx.depth = atoi(argv[++n])) <= 0) errx(1, "ERROR: Invalid -q value [ %s ]", argv[n]);
+				continue; }
+			if (!strcmp(p, "-r")) { ctx.recursive = true; continue; }
+			if (!strcmp(p, "-j") && n + 1 < argc) {
+				if ((ctx.threads = atoi(argv[++n])) <= 0) errx(1, "ERROR: Invalid -j value [ %s ]", argv[n]);
+				continue; }
+			if (!strcmp(p, "-n") || !strcmp(p, "--dry-run")) { rmx_dry_run = true; continue; }
+			if (!strcmp(p, "--stats")) { atexit(rmx_stats_print); continue; }
+			if (!strcmp(p, "--stdin")) { use_stdin = true; continue; }
+			if (!strcmp(p, "-0")) { use_stdin = true; delim = 0; continue; }
+			if (!strcmp(p, "-c") && n + 1 < argc) {
+				if ((chunk = atoi(argv[++n])) <= 0) errx(1, "ERROR: Invalid -c value [ %s ]", argv[n]);
+				continue; }
 			if (!strcmp(p, "--")) { args = true; continue; } }
 		file_paths[idx++] = p; }
+	if (use_stdin && idx) errx(1, "ERROR: File arguments cannot be used with --stdin/-0 options");
+	if (!use_stdin) chunk = idx ? idx : 1;
 
-	int open_resolve = RESOLVE_NO_SYMLINKS;
-	if (dev_check) open_resolve |= RESOLVE_NO_XDEV;
-
-	int dir_fd, dir_offset;
-	if (dir_check) {
-		char *dir = realpath(dir_check, NULL);
-		if (!dir) err(1, "ERROR: Base-dir is missing/inaccessible [ %s ]", dir_check);
-		dir_fd = openat2( AT_FDCWD, dir,
+	if (dev_check) ctx.open_resolve |= RESOLVE_NO_XDEV;
+	if (ctx.dir_check) {
+		char *dir = realpath(ctx.dir_check, NULL); rmx_stat(realpath);
+		if (!dir) err(1, "ERROR: Base-dir is missing/inaccessible [ %s ]", ctx.dir_check);
+		ctx.dir_fd = openat2( AT_FDCWD, dir,
 			.flags=O_RDONLY|O_DIRECTORY, .resolve=RESOLVE_NO_SYMLINKS );
-		if (dir_fd < 0) err(1, "ERROR: Base-dir open failed [ %s ]", dir_check);
-		if (fchdir(dir_fd)) err(1, "ERROR: Base-dir chdir failed [ %s ]", dir_check);
-		dir_check = dir; dir_offset = strlen(dir_check); }
-	else dir_fd = AT_FDCWD;
-
-	int res = 0, nn = idx; idx = 0;
-	for (int n = 0; n < nn; n++) {
-		char *p = file_paths[n], *p_name = basename(strdup(p));
-		char *p_dir = realpath(dirname(strdup(p)), NULL);
-		if (!p_dir) {
-			if (!(force && errno == ENOENT)) {
-				warn("ERROR: File-dir access error [ %s ]", p); res |= 1; }
-			continue; }
+		if (ctx.dir_fd < 0) err(1, "ERROR: Base-dir open failed [ %s ]", ctx.dir_check);
+		if (fchdir(ctx.dir_fd)) err(1, "ERROR: Base-dir chdir failed [ %s ]", ctx.dir_check);
+		ctx.dir_check = dir; ctx.dir_offset = strlen(dir); }
+	else ctx.dir_fd = AT_FDCWD;
 
-		if (dir_check) {
-			if ( strncmp(p_dir, dir_check, dir_offset)
-					|| (p_dir[dir_offset] != '/' && p_dir[dir_offset] != 0) ) {
-				warnx("ERROR: Path is not inside base-dir [ %s ]", p);
-				res |= 2; continue; }
-			p_dir = strlen(p_dir) > dir_offset + 1 ? p_dir + dir_offset + 1 : NULL; }
+	// All per-chunk arrays are allocated once, so memory use doesn't depend on number of paths
+	rmx_dirs_init(&ctx.dirs, chunk);
+	if ( !(ctx.file_dirs = calloc(chunk, sizeof(struct rmx_dir *)))
+			|| !(ctx.file_names = calloc(chunk, sizeof(char *)))
+			|| !(ctx.file_bufs = calloc(chunk, sizeof(char *)))
+			|| !(ctx.file_paths = calloc(chunk, sizeof(char *))) )
+		err(1, "ERROR: Failed to allocate path arrays");
+	if (rmx_dry_run) ctx.depth = 0; // no point batching fstatat() checks
+	if (ctx.depth && rmx_uring_init(&ctx.r, ctx.depth)) {
+		warn("WARNING: io_uring setup failed, using unlinkat() loop"); ctx.depth = 0; }
+	if (!use_stdin) return rmx_chunk(&ctx, file_paths, idx);
 
-		file_dir_fds[idx] = !p_dir ? dir_fd :
-			openat2(dir_fd, p_dir, .flags=O_RDONLY|O_DIRECTORY, .resolve=open_resolve);
-		if (file_dir_fds[idx] < 0) {
-			if (!(force && errno == ENOENT)) {
-				warn("ERROR: File-dir access error [ %s ]", p); res |= 1; }
-			continue; }
-		file_paths[idx] = p; file_names[idx++] = p_name; }
-	if (res) return res;
-
-	for (int n = 0; n < idx; n++)
-		if (unlinkat(file_dir_fds[n], file_names[n], 0))
-			if (!(force && errno == ENOENT))
-				err(res | 4, "ERROR: Failed to remove file [ %s ]", file_paths[n]);
+	char **lines = calloc(chunk, sizeof(char *));
+	size_t line_len = 0; ssize_t n;
+	if (!lines) err(1, "ERROR: Failed to allocate path arrays");
+	int res = 0; idx = 0;
+	while (!res) {
+		n = getdelim(lines + idx, &line_len, delim, stdin);
+		if (n > 0) {
+			if (lines[idx][n-1] == delim) lines[idx][n-1] = 0;
+			if (*lines[idx]) { idx++; line_len = 0; } }
+		if (idx == chunk || (n < 0 && idx)) {
+			res = rmx_chunk(&ctx, lines, idx);
+			for (; idx > 0; idx--) { free(lines[idx-1]); lines[idx-1] = NULL; } }
+		if (n < 0) break; }
+	if (ferror(stdin)) err(res | 1, "ERROR: Failed to read paths from stdin");
 	return res;
 }